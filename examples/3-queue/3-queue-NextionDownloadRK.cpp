@@ -0,0 +1,20 @@
+#include "Particle.h"
+
+#include "NextionDownloadQueue.h"
+
+SerialLogHandler logHandler(LOG_LEVEL_INFO);
+NextionDownloadQueue displayQueue;
+
+void setup() {
+	Serial.begin(9600);
+
+	// Both files come from the same server, so the second check reuses the first connection
+	displayQueue.addJob(Serial1, 0).withHostname("download.example.com").withPort(8080).withPathPartOfUrl("panel1.tft");
+	displayQueue.addJob(Serial2, 32).withHostname("download.example.com").withPort(8080).withPathPartOfUrl("panel2.tft");
+
+	displayQueue.setup();
+}
+
+void loop() {
+	displayQueue.loop();
+}
@@ -0,0 +1,127 @@
+#include "Particle.h"
+
+#include "NextionDownloadRK.h"
+
+// Measures the per-byte cost of the inner loops of the download path on the device, using the CPU cycle
+// counter. Each benchmark calls the same library code the download uses.
+//
+// This only prints the results. Regressions are caught by the same benchmarks on a computer, which
+// compares them with stored baselines (make -C tools bench, see tools/nextion-benchmark).
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(MANUAL);
+
+SerialLogHandler logHandler(LOG_LEVEL_INFO);
+
+static const int ITERATIONS = 100;
+
+enum {
+	BENCH_HEADER_PARSE = 0,
+	BENCH_HEADER_DISCARD,
+	BENCH_ACK_SCAN,
+	BENCH_MD5_UPDATE,
+	BENCH_STATE_DISPATCH,
+	BENCH_COUNT
+};
+
+static const char * const benchNames[BENCH_COUNT] = {
+	"header parse", "header discard", "ack scan", "MD5_Update", "state dispatch"
+};
+
+static const char header[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Date: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+		"Server: Apache/2.4.18 (Ubuntu)\r\n"
+		"Last-Modified: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+		"ETag: \"3a2c1-522a29c5e4d40\"\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Content-Length: 238273\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"\r\n";
+
+static char block[NextionDownload::BUFFER_SIZE];
+static char scratch[NextionDownload::BUFFER_SIZE];
+static volatile uint32_t sink;
+
+// Never checks, so loop() stays in the done state
+static NextionDownload idleDownload(Serial1, 0);
+
+// Returns the cycles per 1024 bytes processed
+static uint32_t runBench(int bench) {
+	size_t bytesPerIteration = NextionDownload::BUFFER_SIZE;
+	NextionResponseDecoder decoder;
+	MD5_CTX md5Ctx;
+	NextionDownload::ResponseHeader responseHeader;
+	size_t headerLength;
+
+	decoder.setUploadMode(true);
+	MD5_Init(&md5Ctx);
+
+	uint32_t start = System.ticks();
+
+	for(int iter = 0; iter < ITERATIONS; iter++) {
+		switch(bench) {
+		case BENCH_HEADER_PARSE:
+			// The parse is done in place, so it needs a fresh copy each time
+			bytesPerIteration = sizeof(header) - 1;
+			memcpy(scratch, header, sizeof(header));
+			sink += NextionDownload::parseResponseHeader(scratch, headerLength, responseHeader);
+			break;
+
+		case BENCH_HEADER_DISCARD:
+			// Moving the data after the header to the start of the buffer
+			bytesPerIteration = sizeof(scratch) - (sizeof(header) - 1);
+			sink += NextionDownload::consumeBuffer(scratch, sizeof(scratch), sizeof(header) - 1);
+			break;
+
+		case BENCH_ACK_SCAN:
+			// What the display sends for each block during an upload is the 0x05 ack, and the decoder is
+			// reset before each block is sent, so this is the ack cost per block of data
+			decoder.reset();
+			sink += decoder.handleByte(0x05);
+			break;
+
+		case BENCH_MD5_UPDATE:
+			MD5_Update(&md5Ctx, block, sizeof(block));
+			break;
+
+		case BENCH_STATE_DISPATCH:
+			// One loop() call per app loop when idle; reported per 1024 calls
+			for(size_t ii = 0; ii < 1024; ii++) {
+				idleDownload.loop();
+			}
+			bytesPerIteration = 1024;
+			break;
+		}
+	}
+
+	uint32_t cycles = System.ticks() - start;
+
+	return (uint32_t) (((uint64_t)cycles * 1024) / ((uint64_t)bytesPerIteration * ITERATIONS));
+}
+
+void setup() {
+	Serial.begin(9600);
+	waitFor(Serial.isConnected, 10000);
+
+	// Representative TFT data without 0x05, 0x08 or 0xFF terminators
+	for(size_t ii = 0; ii < sizeof(block); ii++) {
+		block[ii] = (char) (0x10 + (ii * 7) % 0xe0);
+	}
+
+	idleDownload.withCheckModeManual();
+	idleDownload.loop();
+
+	uint32_t ticksPerUs = System.ticksPerMicrosecond();
+
+	for(int bench = 0; bench < BENCH_COUNT; bench++) {
+		uint32_t cyclesPerKB = runBench(bench);
+		uint32_t nsPerByte = (uint32_t) (((uint64_t)cyclesPerKB * 1000) / ((uint64_t)ticksPerUs * 1024));
+
+		Log.info("%-15s %8lu cycles/KB %6lu ns/byte", benchNames[bench],
+				(unsigned long) cyclesPerKB, (unsigned long) nsPerByte);
+	}
+}
+
+void loop() {
+}
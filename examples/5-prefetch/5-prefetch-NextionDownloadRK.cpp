@@ -0,0 +1,30 @@
+#include "Particle.h"
+
+#include "NextionDownloadRK.h"
+
+SerialLogHandler logHandler(LOG_LEVEL_INFO);
+NextionDownload display(Serial1, 0);
+
+// Requires a Gen 3 device (Argon, Boron, B Series) with Device OS 2.0 or later for the file system
+void setup() {
+	Serial.begin(9600);
+
+	// Download in the background at up to 2 Kbytes/sec while the current UI keeps running. The journal lets
+	// a flash interrupted by a reset continue from the staged file.
+	display.withHostname("download.example.com").withPort(8080).withPathPartOfUrl("CompPicture_v0_32.tft")
+		.withPrefetchFile("/usr/display.tft")
+		.withJournalLocation(NextionDownload::EEPROM_BUFFER_SIZE)
+		.withMaxBytesPerSecond(2048);
+
+	display.setup();
+}
+
+void loop() {
+	display.loop();
+
+	if (display.getIsDone() && display.isUpdateReady()) {
+		// A real application would wait for a maintenance window here, like when the display is asleep
+		Log.info("update ready, flashing now");
+		display.flashPendingNow();
+	}
+}
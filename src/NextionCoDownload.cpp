@@ -0,0 +1,380 @@
+#include "NextionCoDownload.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <cstddef>
+
+// Built-in storage, aligned for anything a frame can hold
+alignas(std::max_align_t) static uint8_t defaultFrames[NextionFramePool::DEFAULT_NUM_FRAMES * NextionFramePool::FRAME_SIZE];
+static bool poolInitialized = false;
+
+NextionFramePool::FreeFrame *NextionFramePool::freeList = NULL;
+size_t NextionFramePool::numFree = 0;
+size_t NextionFramePool::largestRequest = 0;
+
+// static
+void *NextionFramePool::allocate(size_t size) {
+	if (!poolInitialized) {
+		setStorage(defaultFrames, sizeof(defaultFrames));
+	}
+	if (size > largestRequest) {
+		largestRequest = size;
+	}
+	if (size > FRAME_SIZE || freeList == NULL) {
+		Log.info("no coroutine frame for %u bytes (%u free)", (unsigned) size, (unsigned) numFree);
+		return NULL;
+	}
+	FreeFrame *frame = freeList;
+	freeList = frame->next;
+	numFree--;
+	return frame;
+}
+
+// static
+void NextionFramePool::release(void *frame) {
+	FreeFrame *freeFrame = (FreeFrame *) frame;
+	freeFrame->next = freeList;
+	freeList = freeFrame;
+	numFree++;
+}
+
+// static
+void NextionFramePool::setStorage(void *storage, size_t size) {
+	poolInitialized = true;
+	freeList = NULL;
+	numFree = 0;
+
+	// Frames must be aligned like the heap would align them
+	uintptr_t start = ((uintptr_t) storage + alignof(std::max_align_t) - 1) & ~(uintptr_t)(alignof(std::max_align_t) - 1);
+	size_t usable = size - (start - (uintptr_t) storage);
+	for(size_t ii = usable / FRAME_SIZE; ii > 0; ii--) {
+		release((void *)(start + (ii - 1) * FRAME_SIZE));
+	}
+}
+
+
+NextionTask &NextionTask::operator=(NextionTask &&other) noexcept {
+	if (this != &other) {
+		reset();
+		handle = other.handle;
+		other.handle = nullptr;
+	}
+	return *this;
+}
+
+void NextionTask::reset() {
+	if (handle) {
+		handle.destroy();
+		handle = nullptr;
+	}
+}
+
+
+NextionCoDownload::NextionCoDownload(USARTSerial &serial) : serial(serial) {
+}
+
+NextionCoDownload::~NextionCoDownload() {
+	// Destroying a suspended coroutine also destroys the one it's waiting for
+	task.reset();
+	if (buffer != NULL && !bufferIsExternal) {
+		free(buffer);
+	}
+}
+
+void NextionCoDownload::requestCheck() {
+	if (!isDone) {
+		Log.info("download already running");
+		return;
+	}
+	isDone = false;
+	succeeded = false;
+	error = "";
+	dataOffset = 0;
+	dataSize = 0;
+	bufferOffset = 0;
+
+	if (buffer == NULL) {
+		buffer = (char *) malloc(BUFFER_SIZE);
+		if (buffer == NULL) {
+			fail("could not allocate buffer");
+			cleanup();
+			return;
+		}
+	}
+
+	task = run();
+	if (!task.isValid()) {
+		fail("no coroutine frame");
+		cleanup();
+		return;
+	}
+	task.start();
+}
+
+void NextionCoDownload::loop() {
+	if (waitingHandle && waitingPoll(waitingAwaiter)) {
+		std::coroutine_handle<> handle = waitingHandle;
+		waitingHandle = nullptr;
+		handle.resume();
+	}
+
+	if (task.isDone()) {
+		succeeded = task.getResult();
+		cleanup();
+	}
+}
+
+void NextionCoDownload::suspend(std::coroutine_handle<> handle, bool (*poll)(void *), void *awaiter) {
+	waitingHandle = handle;
+	waitingPoll = poll;
+	waitingAwaiter = awaiter;
+}
+
+bool NextionCoDownload::ReadAwaiter::poll() {
+	int count = owner->client->read(buf, size);
+	if (count > 0) {
+		result = count;
+		return true;
+	}
+	if (!owner->client->connected() || millis() - startMs >= timeoutMs) {
+		result = 0;
+		return true;
+	}
+	return false;
+}
+
+bool NextionCoDownload::WriteAwaiter::poll() {
+	// Only write what fits in the TX buffer so loop() never blocks while the data is clocked out
+	int avail = owner->serial.availableForWrite();
+	if (avail > 0 && offset < size) {
+		size_t writeSize = size - offset;
+		if (writeSize > (size_t) avail) {
+			writeSize = (size_t) avail;
+		}
+		size_t written = owner->serial.write(&buf[offset], writeSize);
+		if (written > 0) {
+			offset += written;
+			startMs = millis();
+		}
+	}
+	return offset >= size || millis() - startMs >= stallMs;
+}
+
+bool NextionCoDownload::ReplyAwaiter::poll() {
+	while(owner->serial.available()) {
+		token = owner->decoder.handleByte((uint8_t) owner->serial.read());
+		if (token == NextionResponseDecoder::TOKEN_ACK || token == NextionResponseDecoder::TOKEN_ERROR ||
+			(!ackOnly && token != NextionResponseDecoder::TOKEN_NONE)) {
+			return true;
+		}
+	}
+	token = NextionResponseDecoder::TOKEN_NONE;
+	return millis() - startMs >= timeoutMs;
+}
+
+NextionTask NextionCoDownload::run() {
+	// Find the display
+	static const int bauds[] = {9600,115200,19200,57600,38400,4800,2400};
+	bool found = false;
+	for(size_t ii = 0; ii < sizeof(bauds)/sizeof(bauds[0]) && !found; ii++) {
+		NextionTask probe = tryBaud(bauds[ii]);
+		if (!probe.isValid()) {
+			co_return fail("no coroutine frame");
+		}
+		found = co_await probe;
+	}
+	if (!found) {
+		co_return fail("display not found");
+	}
+
+	// Request the file
+	if (!client->connect(hostname.c_str(), (uint16_t) port)) {
+		co_return fail("could not connect");
+	}
+	size_t requestLength = snprintf(buffer, BUFFER_SIZE,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			pathPartOfUrl.c_str(), hostname.c_str());
+	client->write((const uint8_t *)buffer, requestLength);
+
+	// Read the response header, leaving room for the null terminator
+	size_t headerLength = 0;
+	NextionDownload::ResponseHeader header;
+	while(true) {
+		int count = co_await readSome((uint8_t *)&buffer[bufferOffset], BUFFER_SIZE - 1 - bufferOffset, NextionDownload::DATA_TIMEOUT_MIN_MS);
+		if (count <= 0) {
+			co_return fail("no response from server");
+		}
+		bufferOffset += count;
+		buffer[bufferOffset] = 0;
+		if (NextionDownload::parseResponseHeader(buffer, headerLength, header)) {
+			break;
+		}
+		if (bufferOffset >= BUFFER_SIZE - 1) {
+			co_return fail("response header too large");
+		}
+	}
+	if (header.statusCode != 200 || header.contentLength == 0) {
+		Log.info("status %d contentLength %u", header.statusCode, (unsigned) header.contentLength);
+		co_return fail("bad response");
+	}
+	dataSize = header.contentLength;
+	bufferOffset = NextionDownload::consumeBuffer(buffer, bufferOffset, headerLength);
+
+	// Start the upload
+	Log.info("start download dataSize=%u downloadBaud=%d", (unsigned) dataSize, downloadBaud);
+	sendCommand("");
+	sendCommand("whmi-wri %u,%d,0", (unsigned) dataSize, downloadBaud);
+
+	// Give the display time to process whmi-wri before changing the baud rate, then drop the error reply to
+	// the empty command
+	co_await sleepFor(NextionDownload::START_BAUD_DELAY_MS);
+	readAvailableAndDiscard();
+	serial.begin(downloadBaud);
+	decoder.setUploadMode(true);
+	MD5_Init(&md5Ctx);
+
+	if (co_await awaitAck(NextionDownload::START_ACK_TIMEOUT_MS) != NextionResponseDecoder::TOKEN_ACK) {
+		co_return fail("display did not acknowledge download start");
+	}
+
+	// Send the data in blocks, each acknowledged by the display
+	while(dataOffset < dataSize) {
+		size_t blockSize = dataSize - dataOffset;
+		if (blockSize > BUFFER_SIZE) {
+			blockSize = BUFFER_SIZE;
+		}
+		if (bufferOffset > blockSize) {
+			// The server sent more than Content-Length with the header
+			bufferOffset = blockSize;
+		}
+		while(bufferOffset < blockSize) {
+			int count = co_await readSome((uint8_t *)&buffer[bufferOffset], blockSize - bufferOffset, NextionDownload::DATA_TIMEOUT_STARTED_MIN_MS);
+			if (count <= 0) {
+				co_return fail("server stopped sending data");
+			}
+			bufferOffset += count;
+		}
+		MD5_Update(&md5Ctx, buffer, blockSize);
+
+		// Anything received before the block is sent can't be its ack
+		decoder.reset();
+		readAvailableAndDiscard();
+
+		if (!co_await writeAll((const uint8_t *)buffer, blockSize, NextionDownload::SERIAL_WRITE_STALL_MS)) {
+			co_return fail("timed out writing block to display");
+		}
+
+		// Most of the block may still be in the TX buffer; 10 bits per byte
+		unsigned long txMs = (unsigned long) (((uint64_t)blockSize * 10 * 1000) / (uint32_t) downloadBaud);
+		int token = co_await awaitAck(txMs + ACK_TIMEOUT_MS);
+		if (token != NextionResponseDecoder::TOKEN_ACK) {
+			co_return fail((token == NextionResponseDecoder::TOKEN_ERROR) ? "display returned an error" : "display did not acknowledge block");
+		}
+
+		dataOffset += blockSize;
+		bufferOffset = 0;
+	}
+
+	unsigned char md5[16];
+	MD5_Final(md5, &md5Ctx);
+	char md5Hex[33];
+	for(size_t ii = 0; ii < sizeof(md5); ii++) {
+		sprintf(&md5Hex[ii * 2], "%02x", md5[ii]);
+	}
+	Log.info("downloaded %u bytes, md5 hash=%s", (unsigned) dataSize, md5Hex);
+	client->stop();
+
+	// Wait for the display to restart at its normal baud rate. It doesn't take commands until it sends the
+	// ready frame, and probing after the startup frame would discard it.
+	decoder.setUploadMode(false);
+	serial.begin(displayBaud);
+	unsigned long startMs = millis();
+	while(millis() - startMs < restartWaitTime) {
+		int token = co_await awaitReply(restartWaitTime - (millis() - startMs));
+		if (token == NextionResponseDecoder::TOKEN_FRAME && decoder.isReadyFrame()) {
+			break;
+		}
+	}
+	NextionTask probe = tryBaud(displayBaud);
+	if (probe.isValid() && co_await probe) {
+		Log.info("display restarted after %lu ms", millis() - startMs);
+	}
+
+	co_return true;
+}
+
+NextionTask NextionCoDownload::tryBaud(int baud) {
+	serial.begin(baud);
+	decoder.setUploadMode(false);
+
+	sendCommand("");
+	sendCommand("connect");
+
+	// Wait for the comok reply frame. Other replies (like the error for the empty command) are skipped.
+	bool result = false;
+	unsigned long startMs = millis();
+	while(millis() - startMs < TRY_BAUD_TIMEOUT_MS) {
+		int token = co_await awaitReply(TRY_BAUD_TIMEOUT_MS - (millis() - startMs));
+		if (token == NextionResponseDecoder::TOKEN_FRAME && decoder.frameStartsWith("comok")) {
+			result = true;
+			break;
+		}
+	}
+
+	Log.info("tryBaud %d: %d", baud, result);
+
+	if (result) {
+		displayBaud = baud;
+	}
+	co_return result;
+}
+
+void NextionCoDownload::sendCommand(const char *fmt, ...) {
+	readAvailableAndDiscard();
+
+	char buf[64];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	serial.write(buf);
+
+	serial.write(0xff);
+	serial.write(0xff);
+	serial.write(0xff);
+}
+
+void NextionCoDownload::readAvailableAndDiscard() {
+	while(serial.available()) {
+		(void) serial.read();
+	}
+}
+
+bool NextionCoDownload::fail(const char *error) {
+	Log.info("%s", error);
+	this->error = error;
+	return false;
+}
+
+void NextionCoDownload::cleanup() {
+	task.reset();
+	waitingHandle = nullptr;
+	decoder.setUploadMode(false);
+	client->stop();
+
+	if (buffer != NULL && !bufferIsExternal) {
+		free(buffer);
+		buffer = NULL;
+	}
+	if (!succeeded && error[0] == 0) {
+		error = "failed";
+	}
+	Log.info("done");
+	isDone = true;
+}
+
+#endif /* __cpp_impl_coroutine */
@@ -0,0 +1,305 @@
+#ifndef __NEXTIONCODOWNLOAD_H
+#define __NEXTIONCODOWNLOAD_H
+
+#include "NextionDownloadRK.h"
+
+// The Particle toolchain builds as C++17, which doesn't have coroutines, so this is only built where
+// C++20 coroutines are available, like the host tools (tools/Makefile).
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+
+/**
+ * Fixed pool of memory for the coroutine frames of NextionCoDownload, so running a download never
+ * allocates from the heap. Each download uses up to 2 frames (the download and the baud rate probe
+ * it's waiting for). It's not thread safe; run all of the downloads from the same thread.
+ */
+class NextionFramePool {
+public:
+	static const size_t FRAME_SIZE = 768; // Largest frame; getLargestRequest() shows what's needed
+	static const size_t DEFAULT_NUM_FRAMES = 4;
+
+	/**
+	 * Returns a frame, or NULL if size is larger than FRAME_SIZE or all of them are in use
+	 */
+	static void *allocate(size_t size);
+
+	static void release(void *frame);
+
+	/**
+	 * Uses storage (size bytes) for the frames instead of the built-in storage for DEFAULT_NUM_FRAMES,
+	 * for running more downloads at once. It must stay valid as long as the pool is used. Only call
+	 * this when no frames are in use.
+	 */
+	static void setStorage(void *storage, size_t size);
+
+	static size_t getNumFree() { return numFree; }
+
+	/**
+	 * The largest frame size requested so far, whether it fit or not
+	 */
+	static size_t getLargestRequest() { return largestRequest; }
+
+protected:
+	struct FreeFrame {
+		FreeFrame *next;
+	};
+
+	static FreeFrame *freeList;
+	static size_t numFree;
+	static size_t largestRequest;
+};
+
+/**
+ * A coroutine run by NextionCoDownload. It starts suspended and returns a bool from co_return.
+ * Awaiting it runs it and resumes the caller when it returns. If there was no frame for it, it's
+ * not valid and awaiting it returns false right away.
+ */
+class NextionTask {
+public:
+	struct promise_type {
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+				// Continue the coroutine that was waiting for this one, if any
+				std::coroutine_handle<> continuation = handle.promise().continuation;
+				return continuation ? continuation : std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+
+		NextionTask get_return_object() noexcept { return NextionTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		static NextionTask get_return_object_on_allocation_failure() noexcept { return NextionTask(); }
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+
+		void return_value(bool result) noexcept { this->result = result; }
+		void unhandled_exception() noexcept { abort(); }
+
+		static void *operator new(size_t size) noexcept { return NextionFramePool::allocate(size); }
+		static void operator delete(void *frame) noexcept { NextionFramePool::release(frame); }
+
+		bool result = false;
+		std::coroutine_handle<> continuation;
+	};
+
+	NextionTask() {}
+	explicit NextionTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	NextionTask(NextionTask &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	NextionTask &operator=(NextionTask &&other) noexcept;
+	NextionTask(const NextionTask &) = delete;
+	NextionTask &operator=(const NextionTask &) = delete;
+	~NextionTask() { reset(); }
+
+	bool isValid() const { return (bool) handle; }
+
+	bool isDone() const { return handle && handle.done(); }
+
+	bool getResult() const { return handle ? handle.promise().result : false; }
+
+	/**
+	 * Runs the coroutine until it first waits. Only used for the outermost one; the others are awaited.
+	 */
+	void start() { handle.resume(); }
+
+	/**
+	 * Destroys the frame, returning it to the pool
+	 */
+	void reset();
+
+	bool await_ready() const { return !handle; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+		handle.promise().continuation = caller;
+		return handle;
+	}
+	bool await_resume() const { return getResult(); }
+
+protected:
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * Download engine written as a coroutine, as an alternative to the NextionDownload state machine. The
+ * download is one function (run()) that awaits readSome(), writeAll(), awaitAck() and sleepFor()
+ * instead of being split into states, so the baud rate detection and the wait for the display to
+ * restart don't block either. loop() only resumes the coroutine when what it's waiting for is ready.
+ *
+ * It downloads and flashes the file unconditionally, from one server. It doesn't do what the
+ * state machine does beyond that (If-Modified-Since, mirrors, resuming, the journal, manifests,
+ * staging and keep-alive). connect() on the transport still blocks.
+ *
+ * The buffer is allocated on requestCheck() and freed when done, as with NextionDownload, unless
+ * withBuffer() is used. Frames come from NextionFramePool. Each download needs its own transport.
+ */
+class NextionCoDownload {
+public:
+	NextionCoDownload(USARTSerial &serial);
+	virtual ~NextionCoDownload();
+
+	NextionCoDownload &withHostname(const char *hostname) { this->hostname = hostname; return *this; }
+	NextionCoDownload &withPort(int port) { this->port = port; return *this; }
+	NextionCoDownload &withPathPartOfUrl(const char *pathPartOfUrl) { this->pathPartOfUrl = pathPartOfUrl; return *this; }
+	NextionCoDownload &withTransport(NextionTransport &transport) { this->client = &transport; return *this; }
+	NextionCoDownload &withDownloadBaud(int baud) { downloadBaud = baud; return *this; }
+	NextionCoDownload &withBuffer(char *buffer) { this->buffer = buffer; bufferIsExternal = true; return *this; }
+
+	/**
+	 * Starts a download. It runs from loop().
+	 */
+	void requestCheck();
+
+	void loop();
+
+	bool getIsDone() const { return isDone; }
+
+	/**
+	 * True if the last download was flashed to the display
+	 */
+	bool getSucceeded() const { return succeeded; }
+
+	/**
+	 * Why the last download failed, or an empty string
+	 */
+	const char *getError() const { return error; }
+
+	size_t getDataOffset() const { return dataOffset; }
+
+	size_t getDataSize() const { return dataSize; }
+
+	int getProgress() const { return (dataSize != 0) ? (int) (((uint64_t)dataOffset * 100) / dataSize) : 0; }
+
+	/**
+	 * Base of the awaitables. If poll() is true when awaited the coroutine continues right away, otherwise
+	 * loop() calls poll() and resumes the coroutine when it returns true.
+	 */
+	template<class T>
+	struct Awaiter {
+		Awaiter(NextionCoDownload *owner) : owner(owner), startMs(millis()) {}
+
+		bool await_ready() { return static_cast<T *>(this)->poll(); }
+		void await_suspend(std::coroutine_handle<> handle) { owner->suspend(handle, &pollAwaiter, this); }
+
+		static bool pollAwaiter(void *awaiter) { return static_cast<T *>(static_cast<Awaiter *>(awaiter))->poll(); }
+
+		NextionCoDownload *owner;
+		unsigned long startMs;
+	};
+
+	struct ReadAwaiter : public Awaiter<ReadAwaiter> {
+		ReadAwaiter(NextionCoDownload *owner, uint8_t *buf, size_t size, unsigned long timeoutMs) :
+			Awaiter(owner), buf(buf), size(size), timeoutMs(timeoutMs) {}
+		bool poll();
+		int await_resume() const { return result; }
+
+		uint8_t *buf;
+		size_t size;
+		unsigned long timeoutMs;
+		int result = 0;
+	};
+
+	struct WriteAwaiter : public Awaiter<WriteAwaiter> {
+		WriteAwaiter(NextionCoDownload *owner, const uint8_t *buf, size_t size, unsigned long stallMs) :
+			Awaiter(owner), buf(buf), size(size), stallMs(stallMs) {}
+		bool poll();
+		bool await_resume() const { return offset >= size; }
+
+		const uint8_t *buf;
+		size_t size;
+		unsigned long stallMs;
+		size_t offset = 0;
+	};
+
+	struct ReplyAwaiter : public Awaiter<ReplyAwaiter> {
+		ReplyAwaiter(NextionCoDownload *owner, unsigned long timeoutMs, bool ackOnly) :
+			Awaiter(owner), timeoutMs(timeoutMs), ackOnly(ackOnly) {}
+		bool poll();
+		int await_resume() const { return token; }
+
+		unsigned long timeoutMs;
+		bool ackOnly;
+		int token = NextionResponseDecoder::TOKEN_NONE;
+	};
+
+	struct SleepAwaiter : public Awaiter<SleepAwaiter> {
+		SleepAwaiter(NextionCoDownload *owner, unsigned long ms) : Awaiter(owner), ms(ms) {}
+		bool poll() { return millis() - startMs >= ms; }
+		void await_resume() const {}
+
+		unsigned long ms;
+	};
+
+	/**
+	 * Reads up to size bytes from the server. Returns the number of bytes read, or 0 if the server closed the
+	 * connection or didn't send anything within timeoutMs.
+	 */
+	ReadAwaiter readSome(uint8_t *buf, size_t size, unsigned long timeoutMs) { return ReadAwaiter(this, buf, size, timeoutMs); }
+
+	/**
+	 * Writes size bytes to the display as TX buffer space becomes available. Returns false if the TX buffer
+	 * stayed full for stallMs.
+	 */
+	WriteAwaiter writeAll(const uint8_t *buf, size_t size, unsigned long stallMs) { return WriteAwaiter(this, buf, size, stallMs); }
+
+	/**
+	 * Waits for a token from the display (NextionResponseDecoder::TOKEN_). Returns TOKEN_NONE if there
+	 * was none within timeoutMs.
+	 */
+	ReplyAwaiter awaitReply(unsigned long timeoutMs) { return ReplyAwaiter(this, timeoutMs, false); }
+
+	/**
+	 * Waits for the upload mode ack. Returns TOKEN_ACK, TOKEN_ERROR if the display returned an error, or
+	 * TOKEN_NONE if neither arrived within timeoutMs.
+	 */
+	ReplyAwaiter awaitAck(unsigned long timeoutMs) { return ReplyAwaiter(this, timeoutMs, true); }
+
+	SleepAwaiter sleepFor(unsigned long ms) { return SleepAwaiter(this, ms); }
+
+	static const size_t BUFFER_SIZE = NextionDownload::BUFFER_SIZE;
+	static const unsigned long TRY_BAUD_TIMEOUT_MS = 100;
+	static const unsigned long ACK_TIMEOUT_MS = 1000; // After the block has been clocked out
+
+protected:
+	NextionTask run();
+	NextionTask tryBaud(int baud);
+
+	/**
+	 * Called by an awaitable that isn't ready, to be polled from loop()
+	 */
+	void suspend(std::coroutine_handle<> handle, bool (*poll)(void *), void *awaiter);
+
+	void sendCommand(const char *fmt, ...);
+	void readAvailableAndDiscard();
+	bool fail(const char *error);
+	void cleanup();
+
+	USARTSerial &serial;
+	NextionTransport *client = &defaultTransport;
+	NextionTcpTransport defaultTransport;
+	String hostname;
+	int port = 80;
+	String pathPartOfUrl;
+	int downloadBaud = 115200;
+	int displayBaud = 9600;
+	unsigned long restartWaitTime = 4000;
+
+	NextionTask task;
+	std::coroutine_handle<> waitingHandle;
+	bool (*waitingPoll)(void *) = NULL;
+	void *waitingAwaiter = NULL;
+
+	NextionResponseDecoder decoder;
+	MD5_CTX md5Ctx;
+	char *buffer = NULL;
+	bool bufferIsExternal = false;
+	size_t bufferOffset = 0;
+	size_t dataOffset = 0;
+	size_t dataSize = 0;
+	bool isDone = true;
+	bool succeeded = false;
+	const char *error = "";
+};
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* __NEXTIONCODOWNLOAD_H */
@@ -0,0 +1,129 @@
+#include "NextionDownloadQueue.h"
+
+NextionDownloadQueue::NextionDownloadQueue() {
+}
+
+NextionDownloadQueue::~NextionDownloadQueue() {
+	for(auto it = jobs.begin(); it != jobs.end(); it++) {
+		delete *it;
+	}
+	if (buffer != NULL) {
+		free(buffer);
+	}
+}
+
+NextionDownload &NextionDownloadQueue::addJob(USARTSerial &serial, int eepromLocation) {
+	NextionDownload *job = new NextionDownload(serial, eepromLocation);
+
+	// The queue decides when each job runs and owns the connection
+	job->withCheckModeManual().withKeepAlive().withTransport(*client);
+
+	jobs.push_back(job);
+	return *job;
+}
+
+NextionDownloadQueue &NextionDownloadQueue::withTransport(NextionTransport &transport) {
+	client = &transport;
+	for(auto it = jobs.begin(); it != jobs.end(); it++) {
+		(*it)->withTransport(transport);
+	}
+	return *this;
+}
+
+void NextionDownloadQueue::setup() {
+	// Each job returns as soon as its display reports that it has booted
+	for(auto it = jobs.begin(); it != jobs.end(); it++) {
+		(*it)->setup();
+	}
+}
+
+void NextionDownloadQueue::loop() {
+	if (stateHandler != NULL) {
+		(this->*stateHandler)();
+	}
+}
+
+void NextionDownloadQueue::requestCheck(bool forceDownload /* = false */) {
+	this->forceDownload = forceDownload;
+
+	isDone = false;
+	hasRun = false;
+
+	if (buffer == NULL) {
+		buffer = (char *) malloc(NextionDownload::BUFFER_SIZE);
+		if (buffer == NULL) {
+			Log.info("could not allocate buffer");
+			stateHandler = &NextionDownloadQueue::cleanupState;
+			return;
+		}
+		for(auto it = jobs.begin(); it != jobs.end(); it++) {
+			(*it)->withBuffer(buffer);
+		}
+	}
+
+	hasRun = true;
+
+	currentJob = 0;
+	if (currentJob < jobs.size()) {
+		startJob();
+		stateHandler = &NextionDownloadQueue::runJobState;
+	}
+	else {
+		stateHandler = &NextionDownloadQueue::cleanupState;
+	}
+}
+
+void NextionDownloadQueue::startJob(void) {
+	NextionDownload *job = jobs[currentJob];
+
+	// The job reuses the connection from the previous job only if it's to the server it sends its request to
+	Log.info("starting job %u of %u", currentJob + 1, jobs.size());
+	job->requestCheck(forceDownload);
+}
+
+void NextionDownloadQueue::startState(void) {
+	if (checkMode == NextionDownload::CHECK_MODE_AT_BOOT) {
+		stateHandler = &NextionDownloadQueue::waitConnectState;
+	}
+	else {
+		stateHandler = &NextionDownloadQueue::doneState;
+	}
+}
+
+void NextionDownloadQueue::waitConnectState(void) {
+	if (jobs.empty()) {
+		stateHandler = &NextionDownloadQueue::doneState;
+		return;
+	}
+	if (jobs[0]->networkReady()) {
+		requestCheck(forceDownload);
+	}
+}
+
+void NextionDownloadQueue::runJobState(void) {
+	NextionDownload *job = jobs[currentJob];
+
+	job->loop();
+
+	if (job->getIsDone()) {
+		if (++currentJob < jobs.size()) {
+			startJob();
+		}
+		else {
+			stateHandler = &NextionDownloadQueue::cleanupState;
+		}
+	}
+}
+
+void NextionDownloadQueue::cleanupState(void) {
+	client->stop();
+
+	stateHandler = &NextionDownloadQueue::doneState;
+}
+
+void NextionDownloadQueue::doneState(void) {
+	if (!isDone) {
+		Log.info("queue done");
+		isDone = true;
+	}
+}
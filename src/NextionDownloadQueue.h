@@ -0,0 +1,80 @@
+#ifndef __NEXTIONDOWNLOADQUEUE_H
+#define __NEXTIONDOWNLOADQUEUE_H
+
+#include "NextionDownloadRK.h"
+
+#include <vector>
+
+/**
+ * Runs the checks for several displays and files one at a time, sharing one buffer and one TCP
+ * connection. Consecutive jobs on the same hostname and port reuse the connection using HTTP keep-alive.
+ */
+class NextionDownloadQueue {
+public:
+	NextionDownloadQueue();
+	virtual ~NextionDownloadQueue();
+
+	/**
+	 * Adds a job for the display on serial. eepromLocation is the location to store the download
+	 * modification timestamp for this job, as for NextionDownload. Use the returned object to set the
+	 * hostname, port and path.
+	 */
+	NextionDownload &addJob(USARTSerial &serial, int eepromLocation);
+
+	NextionDownloadQueue &withCheckModeManual() { checkMode = NextionDownload::CHECK_MODE_MANUAL; return *this; }
+	NextionDownloadQueue &withCheckModeAtBoot() { checkMode = NextionDownload::CHECK_MODE_AT_BOOT; return *this; }
+
+	NextionDownloadQueue &withForceDownload() { forceDownload = true; return *this; }
+
+	/**
+	 * Use a transport owned by the caller for all jobs
+	 */
+	NextionDownloadQueue &withTransport(NextionTransport &transport);
+
+	void setup();
+
+	void loop();
+
+	void requestCheck(bool forceDownload = false);
+
+	size_t getNumJobs() const { return jobs.size(); }
+
+	NextionDownload &getJob(size_t index) { return *jobs[index]; }
+
+	/**
+	 * Index of the job currently running. Use getJob() to get its progress and statistics.
+	 */
+	size_t getCurrentJobIndex() const { return currentJob; }
+
+	bool getIsDone() const { return isDone; }
+
+	bool getHasRun() const { return hasRun; }
+
+protected:
+	// State handlers
+	void startState(void);
+	void waitConnectState(void);
+	void runJobState(void);
+	void cleanupState(void);
+	void doneState(void);
+
+	void startJob(void);
+
+	// Settings
+	int checkMode = NextionDownload::CHECK_MODE_AT_BOOT;
+	bool forceDownload = false;
+
+	// Misc stuff
+	std::vector<NextionDownload *> jobs;
+	size_t currentJob = 0;
+	NextionTcpTransport ownTransport;
+	NextionTransport *client = &ownTransport;
+	char *buffer = 0;
+	bool hasRun = false;
+	bool isDone = false;
+
+	// State handler stuff
+	void (NextionDownloadQueue::*stateHandler)(void) = &NextionDownloadQueue::startState;
+};
+
+#endif /* __NEXTIONDOWNLOADQUEUE_H */
@@ -1,12 +1,19 @@
 #include "NextionDownloadRK.h"
 
+#if HAL_PLATFORM_FILESYSTEM
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 // https://www.itead.cc/blog/nextion-hmi-upload-protocol
 
-// For debugging purposes, it's handy to be able to verify the download part vs. the serial part if you're
-// getting checksum errors. Use md5 to generate the md5sum for your .tft file on your server, then enable
-// this to compare the two.
-// #define USE_MD5 1
+// The md5 of the data received from the server is always calculated and logged. It's the same as md5sum of
+// the .tft file on the server, so it can be used to tell download errors from serial errors. If the server
+// sends the md5 (Content-MD5 or Digest: md5=) it's checked automatically. An ETag is only used as the md5
+// with withEtagIsMd5(), as ETags in the same format aren't always the md5 (S3 with SSE-KMS or SSE-C). When sending directly to the display this can only be detected after the fact; with
+// withPrefetchFile() a file that doesn't match is never flashed.
 
 
 NextionDownload::NextionDownload(USARTSerial &serial, int eepromLocation) : serial(serial), eepromLocation(eepromLocation)  {
@@ -17,14 +24,47 @@ NextionDownload::~NextionDownload() {
 }
 
 void NextionDownload::setup() {
-	delay(4000);
+	traceState(NextionTrace::STATE_SETUP);
+
+	if (hasInterruptedDownload()) {
+		// The display is waiting for the rest of the file, so anything sent now would be taken as data
+		Log.info("display has an interrupted download, not probing");
+		return;
+	}
+
+	// Wait for the display to boot, but stop waiting as soon as it says it's up. If the display was already
+	// running (only this device was reset) it won't send anything, so also probe it periodically.
+	serial.begin(9600);
+	currentBaud = 9600;
+	decoder.setUploadMode(false);
+
+	unsigned long startMs = millis();
+	unsigned long probeMs = startMs;
+	bool starting = false;
+	while(millis() - startMs < restartWaitTime) {
+		int token = pollDisplay();
+		if (token == NextionResponseDecoder::TOKEN_FRAME && decoder.isReadyFrame()) {
+			Log.info("display started after %lu ms", millis() - startMs);
+			break;
+		}
+		if (token == NextionResponseDecoder::TOKEN_FRAME && decoder.isStartupFrame()) {
+			// Booting; stop probing so the ready frame that follows isn't discarded
+			starting = true;
+		}
+		if (!starting && millis() - probeMs >= SETUP_PROBE_INTERVAL_MS) {
+			probeMs = millis();
+			if (tryBaud(9600)) {
+				return;
+			}
+		}
+	}
 	tryBaud(9600);
 }
 
 
 void NextionDownload::loop() {
 	if (stateHandler != NULL) {
-		stateHandler(*this);
+		(this->*stateHandler)();
 	}
 }
 
@@ -105,20 +145,48 @@ void NextionDownload::sendCommand(const char *fmt, ...) {
 	serial.write(0xff);
 }
 
+int NextionDownload::pollDisplay() {
+	int token = decoder.poll(serial);
+	if (token == NextionResponseDecoder::TOKEN_ACK) {
+		traceEvent(NextionTrace::EVENT_ACK, millis() - serialStartTime);
+	}
+	else
+	if (token == NextionResponseDecoder::TOKEN_FRAME) {
+		traceEvent(NextionTrace::EVENT_FRAME, decoder.getFrameLength() ? (uint8_t) decoder.getFrame()[0] : 0);
+	}
+	else
+	if (token == NextionResponseDecoder::TOKEN_ERROR) {
+		traceEvent(NextionTrace::EVENT_DISPLAY_ERROR, (uint8_t) decoder.getFrame()[0]);
+	}
+	return token;
+}
+
 bool NextionDownload::tryBaud(int baud) {
 	serial.begin(baud);
+	currentBaud = baud;
+	traceEvent(NextionTrace::EVENT_BAUD, baud);
+
+	decoder.setUploadMode(false);
 
 	sendCommand("");
 	sendCommand("connect");
 
-	// Read
-	char buf[128];
-	readData(buf, sizeof(buf), 100, false);
-
-	bool result = strstr(buf, "comok") != 0;
+	// Wait for the comok reply frame. Other replies (like the error for the empty command) are skipped.
+	bool result = false;
+	unsigned long startMs = millis();
+	while(millis() - startMs < 100) {
+		if (pollDisplay() == NextionResponseDecoder::TOKEN_FRAME && decoder.frameStartsWith("comok")) {
+			result = true;
+			break;
+		}
+	}
 
 	Log.info("tryBaud %d: %d", baud, result);
 
+	if (result) {
+		displayBaud = baud;
+	}
+
 	return result;
 }
 
@@ -136,27 +204,144 @@ bool NextionDownload::findBaud() {
 	if (!result) {
 		// Reset to 9600 if not found
 		serial.begin(9600);
+		currentBaud = 9600;
+		traceEvent(NextionTrace::EVENT_BAUD, 9600);
 	}
 	return result;
 }
 
 bool NextionDownload::startDownload() {
 
+	sendStartCommand();
+	delay(START_BAUD_DELAY_MS);
+	beginUploadMode();
+	serialStartTime = millis();
+
+	unsigned long startMs = millis();
+	while(millis() - startMs < START_ACK_TIMEOUT_MS) {
+		int token = pollDisplay();
+		if (token == NextionResponseDecoder::TOKEN_ACK) {
+			return true;
+		}
+		if (token == NextionResponseDecoder::TOKEN_ERROR) {
+			Log.info("display returned error 0x%02x", decoder.getFrame()[0]);
+			return false;
+		}
+	}
+	return false;
+}
+
+void NextionDownload::sendStartCommand() {
 	Log.info("start download dataSize=%d downloadBaud=%d", dataSize, downloadBaud);
 
 	sendCommand("");
 	sendCommand("whmi-wri %d,%d,0", dataSize, downloadBaud);
-	delay(50);
+}
+
+void NextionDownload::beginUploadMode() {
+	// The error reply to the empty command sent before whmi-wri is still in the receive buffer, and
+	// anything sent before the display switched can't be the ack
+	readAvailableAndDiscard();
+
 	serial.begin(downloadBaud);
+	currentBaud = downloadBaud;
+	traceEvent(NextionTrace::EVENT_BAUD, downloadBaud);
 
-#if USE_MD5
-	MD5_Init(&md5_ctx);
-#endif
+	MD5_Init(&md5Ctx);
+	md5Hex[0] = 0;
+
+	decoder.setUploadMode(true);
+}
+
+unsigned long NextionDownload::getTransmitTimeMs(size_t size) const {
+	// 10 bits per byte (8N1) at the current baud rate
+	return (unsigned long) (((uint64_t)size * 10 * 1000) / (uint32_t) currentBaud);
+}
+
+unsigned long NextionDownload::getAckTimeoutMs(size_t blockSize) const {
+	// When the latency is steady the deviation goes to 0, but the display erases a flash sector for each
+	// block and an occasional erase takes several times longer than usual. Aborting can't be undone, so
+	// the margin has a floor.
+	unsigned long margin = ackLatencyMs + 4 * ackLatencyVarMs;
+	if (margin < ACK_MARGIN_MIN_MS) {
+		margin = ACK_MARGIN_MIN_MS;
+	}
+	return getTransmitTimeMs(blockSize) + margin;
+}
+
+unsigned long NextionDownload::getDataTimeoutMs() const {
+	if (!hasDataStall) {
+		// No measurements yet, use the conservative value
+		return DATA_TIMEOUT_TIME_MS;
+	}
+
+	// Gaps between reads on a working link are only milliseconds, so the floor is what actually applies
+	// most of the time. Once the display is in download mode there may be no other server to fail over to
+	// and aborting leaves it waiting for data, so only give up on a much longer stall.
+	unsigned long minTimeout = downloadStarted ? DATA_TIMEOUT_STARTED_MIN_MS : DATA_TIMEOUT_MIN_MS;
+
+	unsigned long timeout = dataStallMs + 4 * dataStallVarMs;
+	if (timeout < minTimeout) {
+		timeout = minTimeout;
+	}
+	if (timeout > DATA_TIMEOUT_TIME_MS) {
+		timeout = DATA_TIMEOUT_TIME_MS;
+	}
+	return timeout;
+}
 
+void NextionDownload::updateAckLatency(unsigned long sampleMs) {
+	// Smoothed mean and mean deviation with gains of 1/8 and 1/4 (same as TCP RTT estimation)
+	unsigned long diff = (sampleMs > ackLatencyMs) ? (sampleMs - ackLatencyMs) : (ackLatencyMs - sampleMs);
+	ackLatencyVarMs = (3 * ackLatencyVarMs + diff) / 4;
+	ackLatencyMs = (7 * ackLatencyMs + sampleMs) / 8;
+}
+
+void NextionDownload::updateDataStall(unsigned long sampleMs) {
+	if (!hasDataStall) {
+		dataStallMs = sampleMs;
+		dataStallVarMs = sampleMs / 2;
+		hasDataStall = true;
+		return;
+	}
+	unsigned long diff = (sampleMs > dataStallMs) ? (sampleMs - dataStallMs) : (dataStallMs - sampleMs);
+	dataStallVarMs = (3 * dataStallVarMs + diff) / 4;
+	dataStallMs = (7 * dataStallMs + sampleMs) / 8;
+}
 
-	return readAndDiscard(500, false);
+void NextionDownload::setMaxBytesPerSecond(uint32_t bytesPerSecond) {
+	maxBytesPerSecond = bytesPerSecond;
+	rateRefillTime = millis();
 }
 
+size_t NextionDownload::getReadAllowance(size_t requestSize) {
+	if (yieldToForeground) {
+		return 0;
+	}
+	if (maxBytesPerSecond == 0) {
+		return requestSize;
+	}
+
+	unsigned long now = millis();
+	unsigned long elapsed = now - rateRefillTime;
+	uint64_t newTokens = ((uint64_t)elapsed * maxBytesPerSecond) / 1000;
+	if (newTokens > 0) {
+		// Only advance the refill time by the time actually converted to tokens so fractions aren't lost
+		rateRefillTime += (unsigned long) ((newTokens * 1000) / maxBytesPerSecond);
+		if (rateTokens + newTokens >= BUFFER_SIZE) {
+			rateTokens = BUFFER_SIZE;
+			rateRefillTime = now;
+		}
+		else {
+			rateTokens += (size_t) newTokens;
+		}
+	}
+
+	if (requestSize > rateTokens) {
+		requestSize = rateTokens;
+	}
+	return requestSize;
+}
 
 bool NextionDownload::networkReady() {
 #if Wiring_WiFi
@@ -169,8 +354,34 @@ bool NextionDownload::networkReady() {
 }
 
 
+bool NextionDownload::hasInterruptedDownload() {
+	if (journalLocation < 0) {
+		return false;
+	}
+	uint32_t magic = 0;
+	EEPROM.get(journalLocation + offsetof(Journal, magic), magic);
+	return magic == JOURNAL_MAGIC;
+}
+
+bool NextionDownload::hasInterruptedFlash() {
+	if (!hasInterruptedDownload()) {
+		return false;
+	}
+	uint32_t fromStagedFile = 0;
+	EEPROM.get(journalLocation + offsetof(Journal, fromStagedFile), fromStagedFile);
+	return fromStagedFile != 0;
+}
+
 void NextionDownload::startState(void) {
-	if (checkMode == CHECK_MODE_AT_BOOT) {
+	traceState(NextionTrace::STATE_START);
+
+	if (hasInterruptedFlash()) {
+		// Continuing from the staged file doesn't need the network, so don't wait for it
+		requestCheck(forceDownload);
+		return;
+	}
+
+	if (checkMode == CHECK_MODE_AT_BOOT || hasInterruptedDownload()) {
 		stateHandler = &NextionDownload::waitConnectState;
 	}
 	else {
@@ -178,6 +389,8 @@ void NextionDownload::startState(void) {
 	}
 }
 void NextionDownload::waitConnectState(void) {
+	traceState(NextionTrace::STATE_WAIT_CONNECT);
+
 	// This is basically WiFi.ready() or Cellular.ready() depending
 	if (networkReady()) {
 		// We only get here when using checkMode == CHECK_MODE_AT_BOOT and network is ready
@@ -187,6 +400,7 @@ void NextionDownload::waitConnectState(void) {
 }
 
 void NextionDownload::requestCheck(bool forceDownload /* = false */) {
+	traceEvent(NextionTrace::EVENT_CHECK, forceDownload);
 	this->forceDownload = forceDownload;
 
 	isDone = false;
@@ -205,6 +419,47 @@ void NextionDownload::requestCheck(bool forceDownload /* = false */) {
 	// firmware, or we gave up
 	hasRun = true;
 
+	dataSize = 0;
+	dataOffset = 0;
+	responseComplete = false;
+	downloadStarted = false;
+	recovering = false;
+	resumeOffset = 0;
+	failoverCount = 0;
+	lastModified[0] = 0;
+
+	stats = {};
+
+	// Start with the server that answered last time
+	originIndex = preferredOrigin;
+
+	if (startRecovery()) {
+		// The display is still in download mode from before a reset, so it won't answer connect
+		prefetching = false;
+		if (flashingFromFile) {
+			// Continue from the staged file, the network isn't needed
+			bufferOffset = 0;
+			discardRemaining = 0;
+			stateTime = millis();
+			stateHandler = &NextionDownload::dataWaitState;
+			return;
+		}
+		sendRequest();
+		return;
+	}
+
+	// When there's a manifest, it's requested first for the size and md5 of the file
+	fetchingManifest = (manifestPath.length() != 0);
+	manifestSize = 0;
+	manifestMd5[0] = 0;
+
+	if (prefetchPath.length() != 0) {
+		// Downloading to local storage only, the display is not used until flashPendingNow()
+		prefetching = true;
+		sendRequest();
+		return;
+	}
+
 	// Make sure display can be found
 	if (!findBaud()) {
 		Log.info("could not detect display");
@@ -212,190 +467,743 @@ void NextionDownload::requestCheck(bool forceDownload /* = false */) {
 		return;
 	}
 
-	// Connect to server by TCP
-	if (client.connect(hostname, port)) {
-		// Connected by TCP
+	sendRequest();
+}
+
+bool NextionDownload::startRecovery() {
+	if (journalLocation < 0) {
+		return false;
+	}
+
+	Journal journal;
+	EEPROM.get(journalLocation, journal);
+	if (journal.magic != JOURNAL_MAGIC) {
+		return false;
+	}
+
+	if (journal.sentOffset != journal.ackedOffset) {
+		// Reset while a block was being sent. The display has part of it, but there's no way to tell how
+		// much, so sending the block again would put the acks out of step and corrupt the image.
+		Log.info("interrupted while sending a block, can't recover");
+		clearJournal();
+		return false;
+	}
+
+	if (++journal.attempts > JOURNAL_MAX_ATTEMPTS) {
+		Log.info("giving up recovering interrupted download");
+		clearJournal();
+		return false;
+	}
+	EEPROM.put(journalLocation, journal);
+
+	Log.info("recovering interrupted download at %lu of %lu (attempt %lu)",
+			(unsigned long) journal.ackedOffset, (unsigned long) journal.dataSize, (unsigned long) journal.attempts);
+
+	if (journal.fromStagedFile) {
+		// The staged file must still be the one that was being sent
+		if (!openStagedFile(journal.ackedOffset) || dataSize != journal.dataSize ||
+			strncmp(lastModified, journal.lastModified, sizeof(lastModified)) != 0) {
+			Log.info("staged file changed since the interrupted flash, can't recover");
+			closePrefetchFile();
+			clearJournal();
+			return false;
+		}
+		flashingFromFile = true;
+	}
+
+	memcpy(lastModified, journal.lastModified, sizeof(lastModified));
+	lastModified[sizeof(lastModified) - 1] = 0;
+	dataSize = journal.dataSize;
+	dataOffset = journal.ackedOffset;
+	resumeOffset = dataOffset;
+	displayBaud = journal.displayBaud;
+	downloadStarted = true;
+	recovering = true;
+
+	// Continue at the download baud rate, expecting only block acks
+	serial.begin(journal.downloadBaud);
+	currentBaud = journal.downloadBaud;
+	traceEvent(NextionTrace::EVENT_BAUD, currentBaud);
+	decoder.setUploadMode(true);
+
+	MD5_Init(&md5Ctx);
+	md5Hex[0] = 0;
+	transferStartTime = millis();
+
+	return true;
+}
+
+void NextionDownload::saveJournal() {
+	if (journalLocation < 0) {
+		return;
+	}
+
+	Journal journal;
+	journal.magic = JOURNAL_MAGIC;
+	journal.dataSize = dataSize;
+	journal.ackedOffset = dataOffset;
+	journal.sentOffset = dataOffset;
+	journal.downloadBaud = downloadBaud;
+	journal.displayBaud = displayBaud;
+	journal.attempts = 0;
+	journal.fromStagedFile = flashingFromFile;
+	memcpy(journal.lastModified, lastModified, sizeof(journal.lastModified));
+
+	EEPROM.put(journalLocation, journal);
+}
+
+void NextionDownload::updateJournal() {
+	if (journalLocation < 0) {
+		return;
+	}
+
+	uint32_t ackedOffset = dataOffset;
+	EEPROM.put(journalLocation + offsetof(Journal, ackedOffset), ackedOffset);
+}
+
+void NextionDownload::journalBlockSent() {
+	if (journalLocation < 0) {
+		return;
+	}
+
+	// Cleared by updateJournal() when the display acknowledges the block
+	uint32_t sentOffset = dataOffset + bufferOffset;
+	EEPROM.put(journalLocation + offsetof(Journal, sentOffset), sentOffset);
+}
+
+void NextionDownload::clearJournal() {
+	if (journalLocation < 0) {
+		return;
+	}
 
-		char ifModifiedSince[64];
-		ifModifiedSince[0] = 0;
+	uint32_t magic = 0;
+	EEPROM.put(journalLocation + offsetof(Journal, magic), magic);
+}
 
+NextionDownload &NextionDownload::withMirror(const char *hostname, int port) {
+	Mirror mirror;
+	mirror.hostname = hostname;
+	mirror.port = port;
+	mirrors.push_back(mirror);
+	return *this;
+}
+
+const char *NextionDownload::getHostname() const {
+	return (originIndex == 0) ? hostname.c_str() : mirrors[originIndex - 1].hostname.c_str();
+}
+
+int NextionDownload::getPort() const {
+	return (originIndex == 0) ? port : mirrors[originIndex - 1].port;
+}
+
+void NextionDownload::sendRequest() {
+	// Connect to server, or reuse the kept-alive connection from the previous request. If the connection
+	// fails, try each of the mirrors once before giving up.
+	if (keepAlive && client->isConnectedTo(getHostname(), getPort())) {
+		Log.info("reusing connection to %s:%d", getHostname(), getPort());
+		stats.connectionReused = true;
+	}
+	else {
+		// A kept-alive connection to a different server (like a mirror used by the last check) can't be used
+		client->stop();
+
+		while(true) {
+			unsigned long connectStart = millis();
+			if (client->connectTo(getHostname(), getPort())) {
+				stats.connectMs = millis() - connectStart;
+				traceEvent(NextionTrace::EVENT_TCP_CONNECT, stats.connectMs);
+				break;
+			}
+			Log.info("failed to connect to %s:%d", getHostname(), getPort());
+			traceEvent(NextionTrace::EVENT_TCP_CONNECT, NextionTrace::CONNECT_FAILED);
+
+			if (!nextOrigin()) {
+				stateTime = millis();
+				stateHandler = downloadStarted ? &NextionDownload::cleanupState : &NextionDownload::retryWaitState;
+				return;
+			}
+		}
+	}
+
+	char conditional[128];
+	conditional[0] = 0;
+
+	if (fetchingManifest) {
+		// Always get the whole manifest
+	}
+	else
+	if (downloadStarted) {
+		// Continuing a download on another server or after a reset, so request only the part the display
+		// doesn't have yet. After a reset, If-Range makes sure the file hasn't changed in the meantime.
+		size_t len = snprintf(conditional, sizeof(conditional), "Range: bytes=%u-\r\n", (unsigned int) resumeOffset);
+		if (recovering && lastModified[0] != 0) {
+			snprintf(&conditional[len], sizeof(conditional) - len, "If-Range: %s\r\n", lastModified);
+		}
+
+		Log.info("resuming at %u", resumeOffset);
+	}
+	else {
 		char eepromBuffer[EEPROM_BUFFER_SIZE];
 		EEPROM.get(eepromLocation, eepromBuffer);
+		if (prefetching && readStagedLastModified(eepromBuffer)) {
+			// An update is already staged, so only download the file again if it has changed since
+			Log.info("update already staged");
+		}
 		if (forceDownload) {
 			Log.info("forceDownload");
 		}
 		else
-		if (eepromBuffer[0] != 0xff) {
-			snprintf(ifModifiedSince, sizeof(ifModifiedSince), "If-Modified-Since: %s GMT\r\n", eepromBuffer);
+		if ((uint8_t) eepromBuffer[0] != 0xff) {
+			snprintf(conditional, sizeof(conditional), "If-Modified-Since: %s GMT\r\n", eepromBuffer);
 
 			Log.info("If-Modified-Since %s", eepromBuffer);
 		}
 		else {
 			Log.info("no last modification date");
 		}
+	}
 
-		// Send request header
-		size_t count = snprintf(buffer, BUFFER_SIZE,
-				"GET %s HTTP/1.1\r\n"
-				"Host: %s\r\n"
-				"%s"
-				"Connection: close\r\n"
-				"\r\n",
-				pathPartOfUrl.c_str(),
-				hostname.c_str(),
-				ifModifiedSince
-				);
-
-		client.write((const uint8_t *)buffer, count);
+	// Send request header
+	size_t count = snprintf(buffer, BUFFER_SIZE,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"%s"
+			"Connection: %s\r\n"
+			"\r\n",
+			fetchingManifest ? manifestPath.c_str() : pathPartOfUrl.c_str(),
+			getHostname(),
+			conditional,
+			keepAlive ? "keep-alive" : "close"
+			);
+
+	client->write((const uint8_t *)buffer, count);
+
+	bufferOffset = 0;
+
+	Log.info("sent request to %s:%d", getHostname(), getPort());
+	stateTime = millis();
+	stateHandler = &NextionDownload::headerWaitState;
+}
 
-		bufferOffset = 0;
+bool NextionDownload::nextOrigin() {
+	size_t numOrigins = mirrors.size() + 1;
+	if (failoverCount + 1 >= numOrigins) {
+		// Every server has been tried
+		return false;
+	}
+	failoverCount++;
+	originIndex = (originIndex + 1) % numOrigins;
+	return true;
+}
 
-		Log.info("sent request to %s:%d", hostname.c_str(), port);
-		stateTime = millis();
-		stateHandler = &NextionDownload::headerWaitState;
+void NextionDownload::failover() {
+	if (flashingFromFile) {
+		// Reading the staged file stopped early; there's no server to fail over to
+		Log.info("could not read %s", prefetchPath.c_str());
+		stateHandler = &NextionDownload::cleanupState;
+		return;
 	}
-	else {
-		Log.info("failed to connect to %s:%d", hostname.c_str(), port);
+
+	client->stop();
+	traceEvent(NextionTrace::EVENT_TCP_CLOSE, dataOffset);
+
+	if (!nextOrigin()) {
+		// No more mirrors. If the display is already in download mode there's no point in retrying from the start.
 		stateTime = millis();
-		stateHandler = &NextionDownload::retryWaitState;
+		stateHandler = downloadStarted ? &NextionDownload::cleanupState : &NextionDownload::retryWaitState;
+		return;
 	}
 
+	// Any partial block in the buffer is discarded and requested again from the next server
+	resumeOffset = dataOffset;
+	Log.info("failing over to %s:%d", getHostname(), getPort());
+	sendRequest();
+}
+
+unsigned long NextionDownload::getHeaderTimeoutMs() const {
+	unsigned long timeout = getDataTimeoutMs();
+
+	// When there's another server to try, don't wait as long for a slow one
+	if (!mirrors.empty() && timeout > MIRROR_HEADER_TIMEOUT_MS) {
+		timeout = MIRROR_HEADER_TIMEOUT_MS;
+	}
+	return timeout;
 }
 
 void NextionDownload::headerWaitState(void) {
-	if (!client.connected()) {
+	traceState(NextionTrace::STATE_HEADER_WAIT);
+
+	if (!client->connected() && stats.connectionReused && bufferOffset == 0) {
+		// The server closed the kept-alive connection while it was idle (keep-alive timeouts are often
+		// only a few seconds). That's not a server failure, so connect again and resend the request, once.
+		Log.info("kept-alive connection was closed, reconnecting");
+		traceEvent(NextionTrace::EVENT_TCP_DISCONNECT, dataOffset);
+		client->stop();
+		traceEvent(NextionTrace::EVENT_TCP_CLOSE, dataOffset);
+		stats.connectionReused = false;
+		sendRequest();
+		return;
+	}
+	if (!client->connected()) {
 		Log.info("server disconnected unexpectedly");
-		stateTime = millis();
-		stateHandler = &NextionDownload::retryWaitState;
+		traceEvent(NextionTrace::EVENT_TCP_DISCONNECT, dataOffset);
+		failover();
 		return;
 	}
-	if (millis() - stateTime >= DATA_TIMEOUT_TIME_MS) {
+	if (millis() - stateTime >= getHeaderTimeoutMs()) {
 		Log.info("timed out waiting for response header");
-		client.stop();
-
-		stateTime = millis();
-		stateHandler = &NextionDownload::retryWaitState;
+		failover();
 		return;
 	}
-	// Read some data
-	int count = client.read((uint8_t *)&buffer[bufferOffset], BUFFER_SIZE - bufferOffset);
+	// Read some data, leaving room for the null terminator
+	int count = client->read((uint8_t *)&buffer[bufferOffset], BUFFER_SIZE - 1 - bufferOffset);
 	if (count > 0) {
+		traceEvent(NextionTrace::EVENT_TCP_READ, count);
 		Log.info("bufferOffset=%d count=%d", bufferOffset, count);
 
 		bufferOffset += count;
 		buffer[bufferOffset] = 0;
 
-		char *end = strstr(buffer, "\r\n\r\n");
-		if (end != NULL) {
+		ResponseHeader header;
+		size_t headerLength;
+		if (parseResponseHeader(buffer, headerLength, header, etagIsMd5)) {
 			// Have a complete response header
-			*end = 0;
-
-			// Check status code, namely 200 (OK), 304 (not modified) or any other error
-			{
-				int code = 0;
+			int code = header.statusCode;
+			traceEvent(NextionTrace::EVENT_HTTP_STATUS, code);
+			traceEvent(NextionTrace::EVENT_HTTP_HEADER, headerLength);
+			traceEvent(NextionTrace::EVENT_HTTP_LENGTH, header.contentLength);
+
+			// Check status code, namely 200 (OK), 206 (partial content, when resuming), 304 (not modified)
+			// or any other error
+			if (code == 200 || code == 206 || code == 304) {
+				// This server is working, so try it first next time
+				preferredOrigin = originIndex;
+			}
 
-				char *cp = strchr(buffer, ' ');
-				if (cp) {
-					cp++;
-					code = atoi(cp);
+			if (fetchingManifest) {
+				if (code >= 500) {
+					failover();
+					return;
 				}
-				if (code == 304) {
-					Log.info("file not modified, not downloading again");
-					stateHandler = &NextionDownload::cleanupState;
+				if (code != 200) {
+					// Continue without it, the file is still checked against any md5 the server sends
+					Log.info("could not get manifest, was %d", code);
+					client->stop();
+					finishManifest();
+					return;
+				}
+				if (header.contentLength == 0) {
+					// Without a length the end of the manifest can't be found on a kept-alive connection
+					Log.info("manifest has no Content-Length");
+					client->stop();
+					finishManifest();
 					return;
 				}
+				manifestRemaining = header.contentLength;
+				bufferOffset = consumeBuffer(buffer, bufferOffset, headerLength);
+				stateTime = millis();
+				stateHandler = &NextionDownload::manifestWaitState;
+				return;
+			}
 
-				if (code != 200) {
-					Log.info("not an OK response, was %d", code);
+			if (code == 304 && !downloadStarted) {
+				Log.info("file not modified, not downloading again");
+
+				// A 304 response has no body, so the connection can be reused if nothing follows the header
+				responseComplete = (bufferOffset == headerLength);
+				stateHandler = &NextionDownload::cleanupState;
+				return;
+			}
+
+			if (code != 200 && !(code == 206 && downloadStarted)) {
+				Log.info("not an OK response, was %d", code);
+				if (downloadStarted || code >= 500) {
+					// A server error (including 502-504 from a proxy in front of a down origin) may not
+					// happen on a mirror
+					failover();
+				}
+				else {
 					stateHandler = &NextionDownload::cleanupState;
-					return;
 				}
+				return;
 			}
 
+			size_t skipBytes = 0;
 
-			{
-				// Note the data from the Last-Modified header
-				// Last-Modified: <day-name>, <day> <month> <year> <hour>:<minute>:<second> GMT
-				// Last-Modified: Wed, 21 Oct 2015 07:28:00 GMT
-				char *cp = strstr(buffer, "Last-Modified:");
-				if (cp) {
-					cp += 14; // length of "Last-Modified:"
+			if (downloadStarted) {
+				if (code == 206) {
+					if (header.rangeStart != resumeOffset || header.rangeSize != dataSize) {
+						Log.info("mirror returned a different range or file (%u/%u)", header.rangeStart, header.rangeSize);
+						failover();
+						return;
+					}
+				}
+				else {
+					if (recovering && lastModified[0] != 0 && strcmp(header.lastModified, lastModified) != 0) {
+						// If-Range didn't match, so the file was changed since the interrupted download. If the
+						// Last-Modified is the same, the server just doesn't support Range and the skip below applies.
+						Log.info("file changed since the interrupted download, can't recover");
+						clearJournal();
+						stateHandler = &NextionDownload::cleanupState;
+						return;
+					}
 
-					// Skip the space after the Last-Modified
-					if (*cp == ' ') {
-						cp++;
+					// The server ignored the Range header, so discard the part the display already has
+					if (header.contentLength != dataSize) {
+						Log.info("mirror returned a different file (%u bytes)", header.contentLength);
+						failover();
+						return;
 					}
+					skipBytes = resumeOffset;
+				}
+				Log.info("resumed download at %u", resumeOffset);
+			}
+			else {
+				// This is saved to EEPROM only after the whole file has been sent to the display, so an
+				// interrupted download isn't treated as not modified on the next check
+				memcpy(lastModified, header.lastModified, sizeof(lastModified));
+				if (lastModified[0] != 0) {
+					Log.info("last modified: %s", lastModified);
+				}
 
-					char eepromBuffer[EEPROM_BUFFER_SIZE];
-					size_t ii = 0;
-					while(*cp != '\r' && ii < (EEPROM_BUFFER_SIZE - 1)) {
-						eepromBuffer[ii++] = *cp++;
+				// Verify against the md5 from the manifest, or the server's md5 of this file if it sent one
+				if (manifestMd5[0] != 0) {
+					if (header.contentLength != manifestSize) {
+						// Most likely the file is being published; the next check will get the new one
+						Log.info("file size %u does not match the manifest (%u)", header.contentLength, manifestSize);
+						stateHandler = &NextionDownload::cleanupState;
+						return;
 					}
-					eepromBuffer[ii] = 0;
+					memcpy(expectedMd5, manifestMd5, sizeof(expectedMd5));
+				}
+				else {
+					memcpy(expectedMd5, header.md5, sizeof(expectedMd5));
+				}
+				if (expectedMd5[0] != 0) {
+					Log.info("expected md5: %s", expectedMd5);
+				}
 
-					Log.info("last modified: %s", eepromBuffer);
-					EEPROM.put(eepromLocation, eepromBuffer);
+				// The Content-Length is required as the Nextion protocol requires the length before sending
+				// segments and we don't have enough RAM to buffer it first.
+				dataSize = header.contentLength;
+				if (dataSize == 0) {
+					Log.info("unable to get length of data");
+					stateHandler = &NextionDownload::cleanupState;
+					return;
 				}
-			}
 
-			// Note the data size from the Content-Length. This is required as the Nextion protocol requires
-			// the length before sending segments and we don't have enough RAM to buffer it first.
-			{
-				char *cp = strstr(buffer, "Content-Length:");
-				if (cp) {
-					cp += 15; // length of "Content-Length:"
-					while(*cp == ' ') {
-						cp++;
+				dataOffset = 0;
+
+				if (prefetching) {
+					if (!openPrefetchFile()) {
+						stateHandler = &NextionDownload::cleanupState;
+						return;
 					}
-					dataSize = atoi(cp);
+					MD5_Init(&md5Ctx);
+					md5Hex[0] = 0;
+					downloadStarted = true;
+
+					Log.info("prefetching %d bytes", dataSize);
+					transferStartTime = millis();
+				}
+				else {
+					// Send the request to start downloading to the display. startWaitState waits for it to
+					// accept it while the body stays in the buffer and TCP receive window.
+					sendStartCommand();
+					serialStartTime = millis();
 				}
 			}
-			if (dataSize == 0) {
-				Log.info("unable to get length of data");
-				stateHandler = &NextionDownload::cleanupState;
-				return;
+
+			// Discard the header, and any data the display already has that arrived with it
+			size_t skip = bufferOffset - headerLength;
+			if (skip > skipBytes) {
+				skip = skipBytes;
+			}
+			bufferOffset = consumeBuffer(buffer, bufferOffset, headerLength + skip);
+			discardRemaining = skipBytes - skip;
+			stateTime = millis();
+			if (downloadStarted) {
+				stateHandler = &NextionDownload::dataWaitState;
 			}
+			else {
+				stateHandler = &NextionDownload::startWaitState;
+			}
+		}
+	}
+
+}
 
+// static
+bool NextionDownload::parseResponseHeader(char *buffer, size_t &headerLength, ResponseHeader &header, bool etagIsMd5) {
+	char *end = strstr(buffer, "\r\n\r\n");
+	if (end == NULL) {
+		return false;
+	}
+	headerLength = (end + 4) - buffer;
 
-			dataOffset = 0;
+	// The header fields are searched for as strings, so end the string at the end of the header
+	*end = 0;
 
-			// Send the request to start downloading to the display
-			if (!startDownload()) {
-				Log.info("display did not acknowledge download start");
-				stateHandler = &NextionDownload::cleanupState;
-				return;
-			}
+	header = {};
 
-			Log.info("downloading %d bytes", dataSize);
+	// Status line: HTTP/1.1 200 OK
+	char *cp = strchr(buffer, ' ');
+	if (cp) {
+		header.statusCode = atoi(cp + 1);
+	}
 
-			// Discard the header
-			end += 4; // the \r\n\r\n part
+	// The size of the data from the Content-Length. For a 200 response this is the size of the file.
+	cp = strstr(buffer, "Content-Length:");
+	if (cp) {
+		cp += 15; // length of "Content-Length:"
+		while(*cp == ' ') {
+			cp++;
+		}
+		header.contentLength = atoi(cp);
+	}
 
-			size_t newLength = bufferOffset - (end - buffer);
-			if (newLength > 0) {
-				memmove(buffer, end, newLength);
+	// Content-Range: bytes <start>-<end>/<size>
+	cp = strstr(buffer, "Content-Range:");
+	if (cp) {
+		cp = strstr(cp, "bytes");
+	}
+	if (cp) {
+		cp += 5; // length of "bytes"
+		header.rangeStart = atoi(cp);
+		cp = strchr(cp, '/');
+		if (cp) {
+			header.rangeSize = atoi(cp + 1);
+		}
+	}
+
+	// Last-Modified: <day-name>, <day> <month> <year> <hour>:<minute>:<second> GMT
+	// Last-Modified: Wed, 21 Oct 2015 07:28:00 GMT
+	cp = strstr(buffer, "Last-Modified:");
+	if (cp) {
+		cp += 14; // length of "Last-Modified:"
+
+		// Skip the space after the Last-Modified
+		if (*cp == ' ') {
+			cp++;
+		}
+
+		size_t ii = 0;
+		while(*cp != '\r' && *cp != 0 && ii < (EEPROM_BUFFER_SIZE - 1)) {
+			header.lastModified[ii++] = *cp++;
+		}
+		header.lastModified[ii] = 0;
+	}
+
+	parseMd5Header(buffer, header.md5, etagIsMd5);
+
+	return true;
+}
+
+// static
+size_t NextionDownload::consumeBuffer(char *buffer, size_t length, size_t count) {
+	if (count >= length) {
+		return 0;
+	}
+	memmove(buffer, &buffer[count], length - count);
+	return length - count;
+}
+
+void NextionDownload::manifestWaitState(void) {
+	traceState(NextionTrace::STATE_MANIFEST_WAIT);
+
+	if (manifestRemaining > 0) {
+		if (!client->connected()) {
+			Log.info("server disconnected unexpectedly");
+			traceEvent(NextionTrace::EVENT_TCP_DISCONNECT, dataOffset);
+			failover();
+			return;
+		}
+		if (millis() - stateTime >= getHeaderTimeoutMs()) {
+			Log.info("timed out waiting for manifest");
+			failover();
+			return;
+		}
+
+		// Leave room for the null terminator
+		size_t requestSize = BUFFER_SIZE - 1 - bufferOffset;
+		if (requestSize > manifestRemaining) {
+			requestSize = manifestRemaining;
+		}
+		int count = client->read((uint8_t *)&buffer[bufferOffset], requestSize);
+		if (count <= 0) {
+			return;
+		}
+		traceEvent(NextionTrace::EVENT_TCP_READ, count);
+		bufferOffset += count;
+		manifestRemaining -= count;
+		stateTime = millis();
+	}
+
+	// Check each complete line. The manifest can be much larger than the buffer.
+	buffer[bufferOffset] = 0;
+	char *line = buffer;
+	while(true) {
+		char *end = strchr(line, '\n');
+		if (end == NULL) {
+			if (manifestRemaining > 0) {
+				break;
 			}
-			bufferOffset = newLength;
-			stateTime = millis();
-			stateHandler = &NextionDownload::dataWaitState;
+			// The last line may not end with a newline
+			end = &buffer[bufferOffset];
+		}
+		*end = 0;
+
+		if (manifestMd5[0] == 0 && parseManifestLine(line, getManifestName(), manifestSize, manifestMd5)) {
+			Log.info("manifest: %u bytes, md5 %s", manifestSize, manifestMd5);
+		}
+		if (end == &buffer[bufferOffset]) {
+			line = end;
+			break;
+		}
+		line = end + 1;
+	}
+	if (line == buffer && bufferOffset >= BUFFER_SIZE - 1) {
+		// A line longer than the buffer can't be an entry
+		bufferOffset = 0;
+	}
+	else {
+		bufferOffset = consumeBuffer(buffer, bufferOffset, line - buffer);
+	}
+
+	if (manifestRemaining == 0) {
+		if (manifestMd5[0] == 0) {
+			Log.info("%s is not in the manifest", getManifestName());
+		}
+		finishManifest();
+	}
+}
+
+void NextionDownload::finishManifest() {
+	fetchingManifest = false;
+	sendRequest();
+}
+
+const char *NextionDownload::getManifestName() const {
+	// Names in the manifest are relative to the directory it's in
+	const char *path = pathPartOfUrl.c_str();
+	const char *slash = strrchr(manifestPath.c_str(), '/');
+	if (slash) {
+		size_t dirLength = slash + 1 - manifestPath.c_str();
+		if (strncmp(path, manifestPath.c_str(), dirLength) == 0) {
+			return path + dirLength;
+		}
+	}
+	while(*path == '/') {
+		path++;
+	}
+	return path;
+}
+
+// static
+bool NextionDownload::parseManifestLine(const char *line, const char *name, size_t &size, char *md5Hex) {
+	// <size> <md5> <model> <name>, see tools/tft-manifest
+	if (*line == '#') {
+		return false;
+	}
+	char *cp;
+	unsigned long lineSize = strtoul(line, &cp, 10);
+	if (cp == line || *cp != ' ') {
+		return false;
+	}
+	cp++;
+	for(size_t ii = 0; ii < 32; ii++) {
+		if (!isxdigit(cp[ii])) {
+			return false;
+		}
+	}
+	const char *md5 = cp;
+	cp += 32;
+	if (*cp != ' ') {
+		return false;
+	}
+	// Skip the model
+	cp = strchr(cp + 1, ' ');
+	if (cp == NULL) {
+		return false;
+	}
+	cp++;
+
+	size_t nameLength = strlen(cp);
+	if (nameLength > 0 && cp[nameLength - 1] == '\r') {
+		nameLength--;
+	}
+	if (nameLength != strlen(name) || strncmp(cp, name, nameLength) != 0) {
+		return false;
+	}
+
+	size = lineSize;
+	memcpy(md5Hex, md5, 32);
+	md5Hex[32] = 0;
+	return true;
+}
+
+void NextionDownload::startWaitState(void) {
+	traceState(NextionTrace::STATE_START_WAIT);
+
+	if (!decoder.getUploadMode()) {
+		// Give the display time to process whmi-wri before changing the baud rate
+		if (millis() - serialStartTime >= START_BAUD_DELAY_MS) {
+			beginUploadMode();
+			serialStartTime = millis();
+		}
+		return;
+	}
+
+	int token = pollDisplay();
+	if (token == NextionResponseDecoder::TOKEN_ERROR) {
+		Log.info("display returned error 0x%02x", decoder.getFrame()[0]);
+		stateHandler = &NextionDownload::cleanupState;
+		return;
+	}
+	if (token != NextionResponseDecoder::TOKEN_ACK) {
+		if (millis() - serialStartTime >= START_ACK_TIMEOUT_MS) {
+			Log.info("display did not acknowledge download start");
+			stateHandler = &NextionDownload::cleanupState;
 		}
+		return;
 	}
 
+	downloadStarted = true;
+	saveJournal();
+
+	Log.info("downloading %d bytes", dataSize);
+	transferStartTime = millis();
+
+	// Time spent waiting for the display is not a network stall
+	stateTime = millis();
+	stateHandler = &NextionDownload::dataWaitState;
 }
 
 void NextionDownload::dataWaitState(void) {
-	if (!client.connected()) {
+	traceState(NextionTrace::STATE_DATA_WAIT);
+
+	if (!flashingFromFile && !client->connected()) {
 		Log.info("server disconnected unexpectedly");
-		stateTime = millis();
-		stateHandler = &NextionDownload::retryWaitState;
+		traceEvent(NextionTrace::EVENT_TCP_DISCONNECT, dataOffset);
+		failover();
 		return;
 	}
-	if (millis() - stateTime >= DATA_TIMEOUT_TIME_MS) {
+	if (millis() - stateTime >= getDataTimeoutMs()) {
 		Log.info("timed out waiting for data");
-		client.stop();
+		traceEvent(NextionTrace::EVENT_ERROR, dataOffset);
+		failover();
+		return;
+	}
 
-		stateTime = millis();
-		stateHandler = &NextionDownload::retryWaitState;
+	if (discardRemaining > 0) {
+		// Skipping data the display already has from a server that doesn't support Range requests
+		size_t requestSize = (discardRemaining < BUFFER_SIZE) ? discardRemaining : BUFFER_SIZE;
+		int count = client->read((uint8_t *)buffer, requestSize);
+		if (count > 0) {
+			traceEvent(NextionTrace::EVENT_TCP_READ, count);
+			discardRemaining -= count;
+			stateTime = millis();
+		}
 		return;
 	}
 
@@ -411,58 +1219,328 @@ void NextionDownload::dataWaitState(void) {
 		requestSize = BUFFER_SIZE - bufferOffset;
 	}
 
+	// Apply bandwidth shaping. Not reading lets the TCP receive window fill, which throttles the server.
+	if (!flashingFromFile) {
+		requestSize = getReadAllowance(requestSize);
+	}
+	if (requestSize == 0) {
+		// Being throttled is not a network stall
+		stateTime = millis();
+		return;
+	}
+
 	// Log.info("bufferOffset=%d dataLeft=%d requestSize=%d dataOffset=%d", bufferOffset, dataLeft, requestSize, dataOffset);
 
-	int count = client.read((uint8_t *)&buffer[bufferOffset], requestSize);
+	int count = readSource((uint8_t *)&buffer[bufferOffset], requestSize);
 	if (count > 0) {
+		traceEvent(NextionTrace::EVENT_TCP_READ, count);
+		if (maxBytesPerSecond != 0 && !flashingFromFile) {
+			rateTokens -= count;
+		}
+		updateDataStall(millis() - stateTime);
+
 		bufferOffset += count;
 		stateTime = millis();
 
 		if (bufferOffset == dataLeft) {
+			MD5_Update(&md5Ctx, buffer, bufferOffset);
+
+			if (prefetching) {
+				// Got a whole buffer of data (or last partial buffer), save it
+				if (!writePrefetchFile()) {
+					stateHandler = &NextionDownload::cleanupState;
+					return;
+				}
+				blockComplete();
+				return;
+			}
+
 			// Got a whole buffer of data (or last partial buffer), send to display
 			Log.info("sending to display dataOffset=%d dataSize=%d", dataOffset, dataSize);
 
-#if USE_MD5
-			MD5_Update(&md5_ctx, buffer, bufferOffset);
-#endif
+			// Anything received before the block is sent can't be its ack
+			decoder.reset();
+			readAvailableAndDiscard();
 
-			serial.write((const uint8_t *)buffer, bufferOffset);
+			journalBlockSent();
 
-			// Wait for the display to acknowledge
-			if (!readAndDiscard(500, true)) {
-				Log.info("display did not acknowledge block");
-				stateHandler = &NextionDownload::cleanupState;
-				return;
+			serialOffset = 0;
+			serialProgressTime = millis();
+			serialTxCapacity = 0;
+			stateHandler = &NextionDownload::serialWriteState;
+
+			// Start writing right away instead of waiting for the next loop
+			serialWriteState();
+		}
+	}
+}
+
+void NextionDownload::serialWriteState(void) {
+	traceState(NextionTrace::STATE_SERIAL_WRITE);
+
+	// Only write what fits in the TX buffer so loop() never blocks while the block is clocked out
+	// How long this takes depends on how often loop() is called, so it's only bounded by how long the
+	// TX buffer stays full. The ack timer starts once the last byte has been queued.
+	int avail = serial.availableForWrite();
+	if (avail > 0) {
+		if ((size_t) avail > serialTxCapacity) {
+			serialTxCapacity = (size_t) avail;
+		}
+		size_t writeSize = bufferOffset - serialOffset;
+		if (writeSize > (size_t) avail) {
+			writeSize = (size_t) avail;
+		}
+		size_t written = serial.write((const uint8_t *)&buffer[serialOffset], writeSize);
+		traceEvent(NextionTrace::EVENT_UART_WRITE, written);
+		serialOffset += written;
+
+		if (written > 0) {
+			serialProgressTime = millis();
+
+			if (serialOffset >= bufferOffset) {
+				// Bytes still in the TX buffer, estimated from the largest free space seen for this block
+				serialPending = serialTxCapacity - (size_t) avail + written;
+				serialStartTime = millis();
+				ackTimeout = getAckTimeoutMs(serialPending);
 			}
+		}
+	}
 
-			dataOffset += bufferOffset;
-			bufferOffset = 0;
-			if (dataOffset >= dataSize) {
-				Log.info("successfully downloaded");
+	int token = pollDisplay();
+	if (token == NextionResponseDecoder::TOKEN_ERROR) {
+		Log.info("display returned error 0x%02x while writing block", decoder.getFrame()[0]);
+		traceEvent(NextionTrace::EVENT_ERROR, dataOffset);
+		clearJournal();
+		stateHandler = &NextionDownload::cleanupState;
+		return;
+	}
+	if (token == NextionResponseDecoder::TOKEN_ACK) {
+		// The display can't have received the whole block yet, so the data is out of sync
+		Log.info("display acknowledged block before it was sent");
+		traceEvent(NextionTrace::EVENT_ERROR, dataOffset);
+		clearJournal();
+		stateHandler = &NextionDownload::cleanupState;
+		return;
+	}
 
-#if USE_MD5
-				unsigned char out[16];
-				char str[34];
+	if (serialOffset >= bufferOffset) {
+		stateHandler = &NextionDownload::ackWaitState;
+	}
+	else
+	if (millis() - serialProgressTime >= SERIAL_WRITE_STALL_MS) {
+		Log.info("timed out writing block to display");
+		traceEvent(NextionTrace::EVENT_ERROR, dataOffset);
+		clearJournal();
+		stateHandler = &NextionDownload::cleanupState;
+	}
+}
 
-				MD5_Final(out, &md5_ctx);
-				for(size_t ii = 0; ii < sizeof(out); ii++) {
-					sprintf(&str[ii * 2], "%02x", out[ii]);
-				}
-				str[32] = 0;
-				Log.info("md5 hash=%s", str);
-#endif
+void NextionDownload::ackWaitState(void) {
+	traceState(NextionTrace::STATE_ACK_WAIT);
 
-				// Wait a few seconds for the display to restart
-				stateHandler = &NextionDownload::restartWaitState;
-				stateTime = millis();
+	// Wait for the display to acknowledge
+	int token = pollDisplay();
+	if (token == NextionResponseDecoder::TOKEN_ERROR) {
+		Log.info("display returned error 0x%02x instead of ack", decoder.getFrame()[0]);
+		traceEvent(NextionTrace::EVENT_ERROR, dataOffset);
+		clearJournal();
+		stateHandler = &NextionDownload::cleanupState;
+		return;
+	}
+
+	if (token != NextionResponseDecoder::TOKEN_ACK) {
+		if (millis() - serialStartTime >= ackTimeout) {
+			Log.info("display did not acknowledge block within %lu ms", ackTimeout);
+			traceEvent(NextionTrace::EVENT_ERROR, dataOffset);
+			clearJournal();
+			stateHandler = &NextionDownload::cleanupState;
+		}
+		return;
+	}
+
+	// The latency is the time beyond what it takes to clock out what was left in the TX buffer
+	unsigned long elapsed = millis() - serialStartTime;
+	unsigned long txMs = getTransmitTimeMs(serialPending);
+	updateAckLatency((elapsed > txMs) ? (elapsed - txMs) : 0);
+
+	blockComplete();
+}
+
+void NextionDownload::blockComplete() {
+	// Time spent on the serial side is not a network stall
+	stateTime = millis();
+
+	dataOffset += bufferOffset;
+	bufferOffset = 0;
+	if (!prefetching) {
+		updateJournal();
+	}
+
+	stats.transferMs = millis() - transferStartTime;
+	if (stats.transferMs > 0) {
+		stats.bytesPerSecond = (uint32_t) (((uint64_t)dataOffset * 1000) / stats.transferMs);
+	}
+
+	if (dataOffset >= dataSize) {
+		Log.info("successfully downloaded in %lu ms (%lu bytes/sec)", stats.transferMs, (unsigned long) stats.bytesPerSecond);
+		responseComplete = true;
+
+		if (prefetching) {
+			finishPrefetch();
+			stateHandler = &NextionDownload::cleanupState;
+			return;
+		}
+
+		clearJournal();
+
+		if (recovering) {
+			// The beginning of the file was sent before the reset, so there's no md5 for the whole file
+			Log.info("md5 not available for a recovered download");
+		}
+		else {
+			finishMd5();
+		}
+
+		if (stats.md5Mismatch) {
+			// Clear the modification timestamp so the next check downloads the file again
+			char eepromBuffer[EEPROM_BUFFER_SIZE];
+			memset(eepromBuffer, 0xff, sizeof(eepromBuffer));
+			EEPROM.put(eepromLocation, eepromBuffer);
+		}
+		else
+		if (lastModified[0] != 0) {
+			EEPROM.put(eepromLocation, lastModified);
+		}
+
+		char stagedLastModified[EEPROM_BUFFER_SIZE];
+		if (flashingFromFile ||
+			(recovering && readStagedLastModified(stagedLastModified) && strcmp(stagedLastModified, lastModified) == 0)) {
+			// The staged update has been installed (possibly by recovering from the network), so don't
+			// report it as ready again
+			closePrefetchFile();
+			removeFile(prefetchPath.c_str());
+		}
+
+		// Listen at the display's normal baud rate for it to report that it has restarted
+		decoder.setUploadMode(false);
+		serial.begin(displayBaud);
+		currentBaud = displayBaud;
+		traceEvent(NextionTrace::EVENT_BAUD, displayBaud);
+
+		stateHandler = &NextionDownload::restartWaitState;
+		stateTime = millis();
+	}
+	else {
+		stateHandler = &NextionDownload::dataWaitState;
+	}
+}
+
+void NextionDownload::finishMd5() {
+	unsigned char out[16];
+
+	MD5_Final(out, &md5Ctx);
+	for(size_t ii = 0; ii < sizeof(out); ii++) {
+		sprintf(&md5Hex[ii * 2], "%02x", out[ii]);
+	}
+	md5Hex[32] = 0;
+	Log.info("md5 hash=%s", md5Hex);
+
+	if (expectedMd5[0] != 0 && strcasecmp(expectedMd5, md5Hex) != 0) {
+		Log.info("md5 does not match expected %s", expectedMd5);
+		stats.md5Mismatch = true;
+	}
+}
+
+// static
+bool NextionDownload::parseMd5Header(const char *header, char *md5Hex, bool etagIsMd5) {
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char *cp;
+
+	// Content-MD5 and Digest are the base64 encoded hash
+	cp = strstr(header, "Content-MD5:");
+	if (cp) {
+		cp += 12; // length of "Content-MD5:"
+	}
+	else {
+		cp = strstr(header, "Digest:");
+		while(cp && *cp != '\r' && *cp != 0 && strncasecmp(cp, "md5=", 4) != 0) {
+			cp++;
+		}
+		if (cp && strncasecmp(cp, "md5=", 4) == 0) {
+			cp += 4;
+		}
+		else {
+			cp = NULL;
+		}
+	}
+	if (cp) {
+		while(*cp == ' ') {
+			cp++;
+		}
+		uint8_t out[16];
+		uint32_t bits = 0;
+		size_t numBits = 0, ii = 0;
+		for(; *cp != 0 && *cp != '=' && ii < sizeof(out); cp++) {
+			const char *pos = strchr(base64, *cp);
+			if (pos == NULL) {
+				break;
+			}
+			bits = (bits << 6) | (uint32_t)(pos - base64);
+			numBits += 6;
+			if (numBits >= 8) {
+				numBits -= 8;
+				out[ii++] = (uint8_t)(bits >> numBits);
+			}
+		}
+		if (ii == sizeof(out)) {
+			for(ii = 0; ii < sizeof(out); ii++) {
+				sprintf(&md5Hex[ii * 2], "%02x", out[ii]);
+			}
+			return true;
+		}
+	}
+
+	if (!etagIsMd5) {
+		return false;
+	}
+
+	// A strong ETag of 32 hex digits is the md5 on S3 (without SSE-KMS or SSE-C) and some other servers
+	cp = strstr(header, "ETag:");
+	if (cp) {
+		cp += 5; // length of "ETag:"
+		while(*cp == ' ') {
+			cp++;
+		}
+		if (*cp == '"') {
+			size_t ii = 0;
+			for(cp++; ii < 32 && isxdigit(cp[ii]); ii++) {
+			}
+			if (ii == 32 && cp[32] == '"') {
+				memcpy(md5Hex, cp, 32);
+				md5Hex[32] = 0;
+				return true;
 			}
 		}
 	}
+	return false;
 }
 
 void NextionDownload::restartWaitState(void) {
+	traceState(NextionTrace::STATE_RESTART_WAIT);
+
+	// The display sends the startup frame (0x00 0x00 0x00) and then ready (0x88) when it boots. It doesn't
+	// take commands until it's ready, and probing after the startup frame would discard the ready frame.
+	int token = pollDisplay();
+	if (token == NextionResponseDecoder::TOKEN_FRAME && decoder.isReadyFrame()) {
+		if (tryBaud(displayBaud)) {
+			Log.info("display restarted after %lu ms", millis() - stateTime);
+			stateHandler = &NextionDownload::cleanupState;
+			return;
+		}
+	}
+
 	if (millis() - stateTime >= restartWaitTime) {
-		// Reset the baud rate
+		// Didn't hear from the display, it may have restarted at a different baud rate
 		findBaud();
 
 		stateHandler = &NextionDownload::cleanupState;
@@ -470,6 +1548,8 @@ void NextionDownload::restartWaitState(void) {
 }
 
 void NextionDownload::retryWaitState(void) {
+	traceState(NextionTrace::STATE_RETRY_WAIT);
+
 	if (!retryOnFailure) {
 		// Not retrying on failure (default), so just clean up
 		stateHandler = &NextionDownload::cleanupState;
@@ -482,21 +1562,218 @@ void NextionDownload::retryWaitState(void) {
 }
 
 void NextionDownload::cleanupState(void) {
-	if (buffer != NULL) {
+	traceState(NextionTrace::STATE_CLEANUP);
+
+	decoder.setUploadMode(false);
+
+	if (fileFd >= 0) {
+		// Only still open if the prefetch or flash did not complete
+		closePrefetchFile();
+		if (prefetching) {
+			removeFile(getPrefetchTempPath().c_str());
+		}
+	}
+	prefetching = false;
+	flashingFromFile = false;
+
+	if (buffer != NULL && !bufferIsExternal) {
 		free(buffer);
 		buffer = NULL;
 	}
-	client.stop();
+
+	// With keep-alive, the connection is left open for the next request only if this response was fully read
+	if (!keepAlive || !responseComplete) {
+		client->stop();
+		traceEvent(NextionTrace::EVENT_TCP_CLOSE, dataOffset);
+	}
 
 	stateHandler = &NextionDownload::doneState;
 }
 
 
 void NextionDownload::doneState(void) {
+	traceState(NextionTrace::STATE_DONE);
+
 	if (!isDone) {
 		Log.info("done");
 		isDone = true;
 	}
 }
 
+bool NextionDownload::isUpdateReady() {
+#if HAL_PLATFORM_FILESYSTEM
+	struct stat st;
+	return prefetchPath.length() != 0 && stat(prefetchPath.c_str(), &st) == 0;
+#else
+	return false;
+#endif
+}
+
+bool NextionDownload::flashPendingNow() {
+#if HAL_PLATFORM_FILESYSTEM
+	if (stateHandler != &NextionDownload::doneState && stateHandler != &NextionDownload::startState) {
+		Log.info("can't flash now, a check is in progress");
+		return false;
+	}
+	if (!isUpdateReady()) {
+		Log.info("no update ready");
+		return false;
+	}
+
+	isDone = false;
+	hasRun = true;
 
+	if (buffer == NULL) {
+		buffer = (char *) malloc(BUFFER_SIZE);
+		if (buffer == NULL) {
+			Log.info("could not allocate buffer");
+			stateHandler = &NextionDownload::cleanupState;
+			return false;
+		}
+	}
+
+	if (!openStagedFile(0)) {
+		stateHandler = &NextionDownload::cleanupState;
+		return false;
+	}
+
+	if (!findBaud()) {
+		Log.info("could not detect display");
+		stateHandler = &NextionDownload::cleanupState;
+		return false;
+	}
+
+	dataOffset = 0;
+	bufferOffset = 0;
+	discardRemaining = 0;
+	downloadStarted = false;
+	recovering = false;
+	prefetching = false;
+	flashingFromFile = true;
+	expectedMd5[0] = 0; // Already checked when it was downloaded
+	stats = {};
+
+	sendStartCommand();
+	serialStartTime = millis();
+	stateTime = millis();
+	stateHandler = &NextionDownload::startWaitState;
+	return true;
+#else
+	return false;
+#endif
+}
+
+int NextionDownload::readSource(uint8_t *buf, size_t size) {
+#if HAL_PLATFORM_FILESYSTEM
+	if (flashingFromFile) {
+		return read(fileFd, buf, size);
+	}
+#endif
+	return client->read(buf, size);
+}
+
+bool NextionDownload::openStagedFile(size_t offset) {
+#if HAL_PLATFORM_FILESYSTEM
+	// The staged file is the Last-Modified value followed by the TFT data
+	struct stat st;
+	fileFd = open(prefetchPath.c_str(), O_RDONLY);
+	if (fileFd < 0 || fstat(fileFd, &st) != 0 || (size_t) st.st_size <= PREFETCH_HEADER_SIZE ||
+		read(fileFd, lastModified, PREFETCH_HEADER_SIZE) != (int) PREFETCH_HEADER_SIZE ||
+		lseek(fileFd, PREFETCH_HEADER_SIZE + offset, SEEK_SET) < 0) {
+		Log.info("could not read %s", prefetchPath.c_str());
+		closePrefetchFile();
+		return false;
+	}
+	lastModified[sizeof(lastModified) - 1] = 0;
+	dataSize = st.st_size - PREFETCH_HEADER_SIZE;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool NextionDownload::readStagedLastModified(char *buf) {
+#if HAL_PLATFORM_FILESYSTEM
+	int fd = open(prefetchPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool result = (read(fd, buf, PREFETCH_HEADER_SIZE) == (int) PREFETCH_HEADER_SIZE);
+	close(fd);
+	buf[PREFETCH_HEADER_SIZE - 1] = 0;
+	return result && buf[0] != 0;
+#else
+	return false;
+#endif
+}
+
+String NextionDownload::getPrefetchTempPath() const {
+	char path[128];
+	snprintf(path, sizeof(path), "%s.tmp", prefetchPath.c_str());
+	return String(path);
+}
+
+bool NextionDownload::openPrefetchFile() {
+#if HAL_PLATFORM_FILESYSTEM
+	// Written to a temporary file so a partial download is never mistaken for a ready update
+	fileFd = open(getPrefetchTempPath().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fileFd < 0) {
+		Log.info("could not create %s", getPrefetchTempPath().c_str());
+		return false;
+	}
+
+	// Save the Last-Modified so it can be stored in EEPROM once the file is flashed
+	if (write(fileFd, lastModified, PREFETCH_HEADER_SIZE) != (int) PREFETCH_HEADER_SIZE) {
+		Log.info("could not write %s", getPrefetchTempPath().c_str());
+		return false;
+	}
+	return true;
+#else
+	Log.info("prefetch requires a file system");
+	return false;
+#endif
+}
+
+bool NextionDownload::writePrefetchFile() {
+#if HAL_PLATFORM_FILESYSTEM
+	if (write(fileFd, buffer, bufferOffset) != (int) bufferOffset) {
+		Log.info("could not write %s", getPrefetchTempPath().c_str());
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+void NextionDownload::finishPrefetch() {
+	finishMd5();
+	closePrefetchFile();
+
+#if HAL_PLATFORM_FILESYSTEM
+	if (stats.md5Mismatch) {
+		removeFile(getPrefetchTempPath().c_str());
+		return;
+	}
+	if (rename(getPrefetchTempPath().c_str(), prefetchPath.c_str()) != 0) {
+		Log.info("could not rename to %s", prefetchPath.c_str());
+		return;
+	}
+	Log.info("update ready in %s", prefetchPath.c_str());
+#endif
+}
+
+void NextionDownload::closePrefetchFile() {
+#if HAL_PLATFORM_FILESYSTEM
+	if (fileFd >= 0) {
+		close(fileFd);
+		fileFd = -1;
+	}
+#endif
+}
+
+void NextionDownload::removeFile(const char *path) {
+#if HAL_PLATFORM_FILESYSTEM
+	unlink(path);
+#endif
+}
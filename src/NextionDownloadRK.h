@@ -3,6 +3,13 @@
 
 #include "Particle.h"
 
+#include <vector>
+
+#include "NextionResponseDecoder.h"
+#include "NextionTrace.h"
+#include "NextionTransport.h"
+#include "md5.h"
+
 
 class NextionDownload {
 public:
@@ -15,6 +22,13 @@ public:
 
 	NextionDownload &withHostname(const char *hostname) { this->hostname = hostname; return *this; }
 	NextionDownload &withPort(int port) { this->port = port; return *this; }
+
+	/**
+	 * Adds a server to use if the one set by withHostname() and withPort() can't be reached or stalls. The
+	 * same path is used on each. Mirrors are tried in the order they are added. If a server fails during
+	 * the download, the next one is asked for the rest of the file with a Range request.
+	 */
+	NextionDownload &withMirror(const char *hostname, int port = 80);
 	NextionDownload &withPathPartOfUrl(const char *pathPartOfUrl) { this->pathPartOfUrl = pathPartOfUrl; return *this; }
 
 	NextionDownload &withCheckModeManual() { checkMode = CHECK_MODE_MANUAL; return *this; }
@@ -24,9 +38,114 @@ public:
 
 	NextionDownload &withRetryOnFailure() { retryOnFailure = true; return *this; }
 
+	/**
+	 * Baud rate the file is sent to the display at (default 115200). The display switches to it for the
+	 * download and goes back to its normal rate when it restarts.
+	 */
+	NextionDownload &withDownloadBaud(int baud) { downloadBaud = baud; return *this; }
+
+	/**
+	 * Keep a journal of the download in progress in EEPROM at eepromLocation (JOURNAL_SIZE bytes). If this
+	 * device resets during a download, the next check continues sending the rest of the file to the display
+	 * (which is still in download mode) using a Range request, or from the staged file if it was
+	 * interrupted in flashPendingNow(), instead of starting over. This is only
+	 * possible if the reset happened between blocks; the display can't report how much of a partial block
+	 * it received, so a reset while a block is being sent can't be recovered.
+	 *
+	 * The journal is updated before and after every block, so this writes to EEPROM about twice per
+	 * 4 Kbytes downloaded.
+	 */
+	NextionDownload &withJournalLocation(int eepromLocation) { journalLocation = eepromLocation; return *this; }
+
+	/**
+	 * Returns true if the journal shows a download was interrupted. When there is one, the check starts
+	 * as soon as the network is ready, even in manual check mode. An interrupted flashPendingNow() is
+	 * continued from the staged file right away, without waiting for the network.
+	 */
+	bool hasInterruptedDownload();
+
+	/**
+	 * Request HTTP keep-alive and leave the connection open after a completed response so the next
+	 * requestCheck() to the same server can reuse it.
+	 */
+	NextionDownload &withKeepAlive() { keepAlive = true; return *this; }
+
+	/**
+	 * Use a transport owned by the caller instead of the internal plain TCP one. This is used to share a
+	 * connection between several NextionDownload objects (see NextionDownloadQueue).
+	 */
+	NextionDownload &withTransport(NextionTransport &transport) { this->client = &transport; return *this; }
+
+	/**
+	 * Record serial, network and state events into trace. Tracing is off unless this is called.
+	 */
+	NextionDownload &withTrace(NextionTrace *trace) { this->trace = trace; return *this; }
+
+	/**
+	 * Download new files in the background to path on the flash file system (Gen 3 devices, Device OS 2.0
+	 * and later) instead of sending them to the display. The display keeps running while downloading,
+	 * which can be throttled with withMaxBytesPerSecond(). When isUpdateReady() returns true, call
+	 * flashPendingNow() to send the file to the display at full serial speed.
+	 */
+	NextionDownload &withPrefetchFile(const char *path) { prefetchPath = path; return *this; }
+
+	/**
+	 * Get the size and md5 of the file from a manifest on the same server before each check. path is the
+	 * path part of the URL of the manifest, as generated by tools/tft-manifest; names in it are relative
+	 * to its directory. If the file is not in the manifest, any md5 the server sends is used instead.
+	 */
+	NextionDownload &withManifest(const char *path) { manifestPath = path; return *this; }
+
+	/**
+	 * Use an ETag of 32 hex digits as the md5 of the file when the server doesn't send Content-MD5 or
+	 * Digest. Only use this if it's known to be true for the server, like S3 without SSE-KMS or SSE-C
+	 * encryption; otherwise every download would fail verification.
+	 */
+	NextionDownload &withEtagIsMd5() { etagIsMd5 = true; return *this; }
+
+	/**
+	 * Returns true if a prefetched file has been downloaded (and verified, if the server sent its md5)
+	 * and is waiting to be sent to the display
+	 */
+	bool isUpdateReady();
+
+	/**
+	 * Sends the prefetched file to the display. Progress is reported the same way as a download, and
+	 * getIsDone() returns true when it's done. Returns false if there is no update ready or a check is
+	 * in progress.
+	 */
+	bool flashPendingNow();
+
+	/**
+	 * Use a buffer owned by the caller instead of allocating one for each check. It must be BUFFER_SIZE bytes.
+	 */
+	NextionDownload &withBuffer(char *buffer) { this->buffer = buffer; bufferIsExternal = true; return *this; }
+
+	/**
+	 * Limit the rate the file is read from the server to bytesPerSecond. 0 (the default) means no limit.
+	 * This can also be changed while downloading with setMaxBytesPerSecond().
+	 */
+	NextionDownload &withMaxBytesPerSecond(uint32_t bytesPerSecond) { setMaxBytesPerSecond(bytesPerSecond); return *this; }
+
+	void setMaxBytesPerSecond(uint32_t bytesPerSecond);
+
+	uint32_t getMaxBytesPerSecond() const { return maxBytesPerSecond; }
+
+	/**
+	 * While set, no data is read from the server so other network traffic (publishes, function calls)
+	 * gets the whole link. Time spent yielding does not count toward the data timeout.
+	 */
+	void setYieldToForeground(bool yield) { yieldToForeground = yield; }
+
+	bool getYieldToForeground() const { return yieldToForeground; }
+
 
 	void setup();
 
+	/**
+	 * Call from the app's loop(). Reading from the server and writing blocks to the display don't block, but
+	 * detecting the baud rate (requestCheck(), and after the display restarts) and connecting to a server do.
+	 */
 	void loop();
 
 	bool networkReady();
@@ -53,10 +172,124 @@ public:
 
 	bool getHasRun() const { return hasRun; }
 
+	/**
+	 * The hostname of the server currently in use (the primary or one of the mirrors)
+	 */
+	const char *getHostname() const;
+
+	int getPort() const;
+
+	/**
+	 * Statistics for the most recent check
+	 */
+	struct Stats {
+		unsigned long connectMs;	// Time to connect
+		bool connectionReused;		// A kept-alive connection was used, so there was no connect
+		unsigned long transferMs;	// Time since the display accepted the download
+		uint32_t bytesPerSecond;	// Average rate data has been acknowledged by the display
+		bool md5Mismatch;			// The data did not match the md5 sent by the server
+	};
+
+	const Stats &getStats() const { return stats; }
+
+	/**
+	 * Number of bytes acknowledged by the display so far in the current download
+	 */
+	size_t getDataOffset() const { return dataOffset; }
+
+	/**
+	 * Size of the file being downloaded, or 0 if not known yet
+	 */
+	size_t getDataSize() const { return dataSize; }
+
+	/**
+	 * The md5 of the last completed download as 32 hex digits, or an empty string
+	 */
+	const char *getMd5() const { return md5Hex; }
+
+	/**
+	 * Download progress from 0 to 100
+	 */
+	int getProgress() const { return (dataSize != 0) ? (int) (((uint64_t)dataOffset * 100) / dataSize) : 0; }
+
+	/**
+	 * Returns how long to wait for the display to acknowledge a block once blockSize bytes of it are left to
+	 * clock out. This is the time that takes at the current baud rate plus the measured ack latency, which
+	 * is never less than ACK_MARGIN_MIN_MS.
+	 */
+	unsigned long getAckTimeoutMs(size_t blockSize) const;
+
+	/**
+	 * Returns how long the server may stall before the download is considered failed. This is derived from
+	 * the measured gaps between TCP reads and is bounded by DATA_TIMEOUT_MIN_MS (DATA_TIMEOUT_STARTED_MIN_MS
+	 * once the display is in download mode) and DATA_TIMEOUT_TIME_MS.
+	 */
+	unsigned long getDataTimeoutMs() const;
+
 	static const size_t BUFFER_SIZE = 4096; // This size is part of the Nextion protocol and can't really be changed
 	static const unsigned long RETRY_WAIT_TIME_MS = 30000;
-	static const unsigned long DATA_TIMEOUT_TIME_MS = 60000;
+	static const unsigned long DATA_TIMEOUT_TIME_MS = 60000; // Upper bound for the adaptive data timeout
+	static const unsigned long DATA_TIMEOUT_MIN_MS = 10000;
+	static const unsigned long DATA_TIMEOUT_STARTED_MIN_MS = 45000; // Once started, giving up can't be undone, so ride out cellular stalls
+	static const unsigned long MIRROR_HEADER_TIMEOUT_MS = 10000; // Header timeout when there's another mirror to try
+	static const unsigned long ACK_MARGIN_MIN_MS = 500; // Least time allowed for the display to write a block, like the old fixed timeout
+	static const unsigned long SERIAL_WRITE_STALL_MS = 1000; // Longest the TX buffer may stay full while writing a block
+	static const unsigned long ACK_LATENCY_INITIAL_MS = 200; // Initial estimate of the display flash write time
 	static const size_t EEPROM_BUFFER_SIZE = 32;
+	static const unsigned long SETUP_PROBE_INTERVAL_MS = 500;
+	static const unsigned long START_BAUD_DELAY_MS = 50; // Time for the display to process whmi-wri before changing baud
+	static const unsigned long START_ACK_TIMEOUT_MS = 500;
+	static const size_t PREFETCH_HEADER_SIZE = EEPROM_BUFFER_SIZE; // Last-Modified stored before the data
+	static const uint32_t JOURNAL_MAGIC = 0x4e444a33;
+	static const uint32_t JOURNAL_MAX_ATTEMPTS = 3;
+
+	struct Journal {
+		uint32_t magic;
+		uint32_t dataSize;
+		uint32_t ackedOffset;
+		uint32_t sentOffset; // End of the block being sent; differs from ackedOffset while a block is in flight
+		int32_t downloadBaud;
+		int32_t displayBaud;
+		uint32_t attempts;
+		uint32_t fromStagedFile; // 1 if flashPendingNow() was sending the prefetched file
+		char lastModified[EEPROM_BUFFER_SIZE];
+	};
+	static const size_t JOURNAL_SIZE = sizeof(Journal);
+
+	/**
+	 * The parts of an HTTP response header used by the download
+	 */
+	struct ResponseHeader {
+		int statusCode;
+		size_t contentLength;
+		size_t rangeStart;		// From Content-Range, for a 206 response
+		size_t rangeSize;		// Size of the whole file from Content-Range
+		char lastModified[EEPROM_BUFFER_SIZE];
+		char md5[33];			// 32 hex digits, or empty if the server didn't send the md5
+	};
+
+	/**
+	 * If buffer (null terminated) contains a complete response header, parses it into header, sets
+	 * headerLength to its length including the blank line and returns true. The header part of buffer
+	 * is modified.
+	 */
+	static bool parseResponseHeader(char *buffer, size_t &headerLength, ResponseHeader &header, bool etagIsMd5 = false);
+
+	/**
+	 * Finds the md5 of the file in Content-MD5 or Digest: md5=, or if etagIsMd5 is true, a strong ETag
+	 * of 32 hex digits. Stores it in md5Hex as 32 hex digits and returns true if found.
+	 */
+	static bool parseMd5Header(const char *header, char *md5Hex, bool etagIsMd5 = false);
+
+	/**
+	 * If line is the manifest entry for name, sets size and md5Hex (32 hex digits) and returns true.
+	 */
+	static bool parseManifestLine(const char *line, const char *name, size_t &size, char *md5Hex);
+
+	/**
+	 * Removes count bytes from the start of buffer, which holds length bytes. Returns the new length.
+	 */
+	static size_t consumeBuffer(char *buffer, size_t length, size_t count);
 
 	// Check mode constants
 	static const int CHECK_MODE_AT_BOOT = 0;
@@ -69,12 +302,65 @@ protected:
 	void startState(void);
 	void waitConnectState(void);
 	void headerWaitState(void);
+	void manifestWaitState(void);
+	void startWaitState(void);
 	void dataWaitState(void);
+	void serialWriteState(void);
+	void ackWaitState(void);
 	void restartWaitState(void);
 	void retryWaitState(void);
 	void cleanupState(void);
 	void doneState(void);
 
+	bool hasInterruptedFlash();
+	bool startRecovery();
+	void saveJournal();
+	void updateJournal();
+	void journalBlockSent();
+	void clearJournal();
+
+	void finishManifest();
+	const char *getManifestName() const;
+
+	void blockComplete();
+	void finishMd5();
+
+	int readSource(uint8_t *buf, size_t size);
+	String getPrefetchTempPath() const;
+	bool openStagedFile(size_t offset);
+	bool readStagedLastModified(char *buf);
+	bool openPrefetchFile();
+	bool writePrefetchFile();
+	void finishPrefetch();
+	void closePrefetchFile();
+	void removeFile(const char *path);
+
+	void sendStartCommand();
+	void beginUploadMode();
+
+	void sendRequest();
+	bool nextOrigin();
+	void failover();
+	unsigned long getHeaderTimeoutMs() const;
+
+	unsigned long getTransmitTimeMs(size_t size) const;
+	void traceEvent(uint8_t event, uint32_t value) {
+		if (trace) {
+			trace->record(event, value);
+		}
+	}
+	int pollDisplay();
+	void traceState(uint8_t state) {
+		if (trace && state != tracedState) {
+			tracedState = state;
+			trace->record(NextionTrace::EVENT_STATE, state);
+		}
+	}
+
+	size_t getReadAllowance(size_t requestSize);
+	void updateAckLatency(unsigned long sampleMs);
+	void updateDataStall(unsigned long sampleMs);
+
 	// Settings
 	USARTSerial &serial;
 	int eepromLocation;
@@ -84,21 +370,79 @@ protected:
 	int checkMode = CHECK_MODE_AT_BOOT;
 	bool forceDownload = false;
 	int downloadBaud = 115200;
+	int currentBaud = 9600;
+	int displayBaud = 9600; // Last baud rate the display answered at
 	bool retryOnFailure = false;
-	unsigned long restartWaitTime = 4000;
+	unsigned long restartWaitTime = 4000; // Upper bound; normally the display's startup message ends the wait
+	bool keepAlive = false;
+	int journalLocation = -1;
+	String prefetchPath;
+
+	struct Mirror {
+		String hostname;
+		int port;
+	};
+	std::vector<Mirror> mirrors;
+	size_t originIndex = 0; // 0 is hostname/port, 1 is mirrors[0], ...
+	size_t preferredOrigin = 0;
+	size_t failoverCount = 0;
+	char expectedMd5[33] = {0};
+	bool etagIsMd5 = false;
+	String manifestPath;
+	bool fetchingManifest = false;
+	size_t manifestRemaining = 0;
+	size_t manifestSize = 0;
+	char manifestMd5[33] = {0};
 
 	// Misc stuff
-	TCPClient client;
+	NextionTcpTransport ownTransport;
+	NextionTransport *client = &ownTransport;
+	Stats stats = {};
+	MD5_CTX md5Ctx;
+	char md5Hex[33] = {0};
 	char *buffer = 0;
+	bool bufferIsExternal = false;
+	bool responseComplete = false;
+	NextionResponseDecoder decoder;
+	NextionTrace *trace = 0;
+	uint8_t tracedState = 0xff;
 	size_t bufferOffset;
 	size_t bufferSize;
-	size_t dataOffset;
-	size_t dataSize;
+	size_t dataOffset = 0;
+	size_t dataSize = 0;
+	unsigned long transferStartTime = 0;
+	bool downloadStarted = false;
+	bool recovering = false;
+	bool prefetching = false;
+	bool flashingFromFile = false;
+	int fileFd = -1;
+	char lastModified[EEPROM_BUFFER_SIZE] = {0};
+	size_t resumeOffset = 0;
+	size_t discardRemaining = 0;
+	size_t serialOffset;
+	unsigned long serialStartTime;
+	unsigned long serialProgressTime;
+	size_t serialTxCapacity;
+	size_t serialPending;
+	unsigned long ackTimeout;
 	bool hasRun = false;
 	bool isDone = false;
 
+	// Running estimates used for the adaptive timeouts (mean and mean deviation, like TCP RTT estimation)
+	unsigned long ackLatencyMs = ACK_LATENCY_INITIAL_MS;
+	unsigned long ackLatencyVarMs = ACK_LATENCY_INITIAL_MS / 2;
+	unsigned long dataStallMs = 0;
+	unsigned long dataStallVarMs = 0;
+	bool hasDataStall = false;
+
+	// Bandwidth shaping (token bucket, holding at most one block of tokens)
+	uint32_t maxBytesPerSecond = 0;
+	size_t rateTokens = BUFFER_SIZE;
+	unsigned long rateRefillTime = 0;
+	bool yieldToForeground = false;
+
 	// State handler stuff
-	std::function<void(NextionDownload&)> stateHandler = &NextionDownload::startState;
+	void (NextionDownload::*stateHandler)(void) = &NextionDownload::startState;
 	unsigned long stateTime = 0;
 
 };
@@ -0,0 +1,151 @@
+#include "NextionResponseDecoder.h"
+
+NextionResponseDecoder::NextionResponseDecoder() {
+}
+
+NextionResponseDecoder::~NextionResponseDecoder() {
+}
+
+void NextionResponseDecoder::reset() {
+	parseState = PARSE_START;
+	frameIndex = 0;
+	frameLength = 0;
+	ffCount = 0;
+	overflow = false;
+}
+
+int NextionResponseDecoder::handleByte(uint8_t c) {
+	switch(parseState) {
+	case PARSE_START:
+		if (uploadMode) {
+			if (c == 0x05) {
+				return TOKEN_ACK;
+			}
+			if (c == 0x08) {
+				offset = 0;
+				offsetCount = 0;
+				parseState = PARSE_OFFSET;
+				return TOKEN_NONE;
+			}
+			if (!isErrorCode(c) && c != 0x88) {
+				// While uploading the display only sends error codes (and 0x00 0x00 0x00 and 0x88 if it
+				// restarts), so anything else is noise, for example from the baud rate change. Starting a
+				// frame on it would swallow the next ack.
+				return TOKEN_NONE;
+			}
+		}
+		frameIndex = 0;
+		ffCount = 0;
+		overflow = false;
+		parseState = PARSE_FRAME;
+		// Continue below to add the first byte to the frame
+		break;
+
+	case PARSE_OFFSET:
+		offset |= ((uint32_t)c) << (8 * offsetCount);
+		if (++offsetCount >= 4) {
+			parseState = PARSE_START;
+			return TOKEN_OFFSET;
+		}
+		return TOKEN_NONE;
+	}
+
+	// PARSE_FRAME
+	if (c == 0xff) {
+		if (++ffCount >= 3) {
+			// The terminating 0xFF bytes are not part of the frame
+			frameLength = frameIndex;
+			parseState = PARSE_START;
+
+			if (overflow) {
+				// Too long to be a reply this code knows about, so don't return part of it
+				frameLength = 0;
+				return TOKEN_NONE;
+			}
+			if (frameLength == 1 && isErrorCode(frame[0])) {
+				return TOKEN_ERROR;
+			}
+			return TOKEN_FRAME;
+		}
+		return TOKEN_NONE;
+	}
+
+	if (uploadMode && c == 0x05 && ffCount == 0) {
+		// Replies in upload mode are a single code followed by the terminator, so a 0x05 here means the
+		// start of the frame was noise and this is really an ack
+		parseState = PARSE_START;
+		return TOKEN_ACK;
+	}
+
+	// 0xFF bytes that turned out not to be a terminator are data
+	for(; ffCount > 0; ffCount--) {
+		if (frameIndex < FRAME_BUFFER_SIZE) {
+			frame[frameIndex++] = 0xff;
+		}
+		else {
+			overflow = true;
+		}
+	}
+	if (frameIndex < FRAME_BUFFER_SIZE) {
+		frame[frameIndex++] = c;
+	}
+	else {
+		overflow = true;
+	}
+	return TOKEN_NONE;
+}
+
+int NextionResponseDecoder::poll(Stream &stream) {
+	while(stream.available()) {
+		int c = stream.read();
+		if (c < 0) {
+			break;
+		}
+		int token = handleByte((uint8_t) c);
+		if (token != TOKEN_NONE) {
+			return token;
+		}
+	}
+	return TOKEN_NONE;
+}
+
+bool NextionResponseDecoder::frameStartsWith(const char *prefix) const {
+	size_t len = strlen(prefix);
+	return frameLength >= len && memcmp(frame, prefix, len) == 0;
+}
+
+bool NextionResponseDecoder::isStartupFrame() const {
+	return frameLength == 3 && frame[0] == 0x00 && frame[1] == 0x00 && frame[2] == 0x00;
+}
+
+bool NextionResponseDecoder::isReadyFrame() const {
+	return frameLength == 1 && frame[0] == 0x88;
+}
+
+// static
+bool NextionResponseDecoder::isErrorCode(uint8_t code) {
+	switch(code) {
+	case 0x00: // Invalid instruction
+	case 0x02: // Invalid component ID
+	case 0x03: // Invalid page ID
+	case 0x04: // Invalid picture ID
+	case 0x05: // Invalid font ID
+	case 0x06: // Invalid file operation
+	case 0x09: // Invalid CRC
+	case 0x11: // Invalid baud rate setting
+	case 0x12: // Invalid waveform ID or channel
+	case 0x1A: // Invalid variable name or attribute
+	case 0x1B: // Invalid variable operation
+	case 0x1C: // Assignment failed to assign
+	case 0x1D: // EEPROM operation failed
+	case 0x1E: // Invalid quantity of parameters
+	case 0x1F: // IO operation failed
+	case 0x20: // Escape character invalid
+	case 0x23: // Variable name too long
+	case 0x24: // Serial buffer overflow
+		return true;
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,100 @@
+#ifndef __NEXTIONRESPONSEDECODER_H
+#define __NEXTIONRESPONSEDECODER_H
+
+#include "Particle.h"
+
+/**
+ * Splits the serial data from a Nextion display into frames (terminated by 0xFF 0xFF 0xFF) and,
+ * in upload mode, the bare upload protocol tokens (0x05 for a block ack, 0x08 followed by a 4-byte
+ * little endian offset).
+ *
+ * Bytes are consumed one at a time from the UART receive buffer into a fixed frame buffer; nothing
+ * is allocated and getFrame() returns a pointer to the frame in place.
+ */
+class NextionResponseDecoder {
+public:
+	// Return values from handleByte() and poll()
+	static const int TOKEN_NONE = 0;	// No complete token yet
+	static const int TOKEN_FRAME = 1;	// A frame is available from getFrame()
+	static const int TOKEN_ERROR = 2;	// An error reply frame, the code is getFrame()[0]
+	static const int TOKEN_ACK = 3;		// Upload mode block ack (0x05)
+	static const int TOKEN_OFFSET = 4;	// Upload mode resume offset (0x08), available from getOffset()
+
+	static const size_t FRAME_BUFFER_SIZE = 128; // Longer frames are discarded. The comok reply is about 70 bytes.
+
+	NextionResponseDecoder();
+	virtual ~NextionResponseDecoder();
+
+	/**
+	 * Discards any partial frame. Call this before sending a command so stale bytes can't be
+	 * mistaken for the reply.
+	 */
+	void reset();
+
+	/**
+	 * In upload mode, 0x05 and 0x08 at the start of a frame are upload protocol tokens instead of
+	 * the start of a reply frame. Bytes that can't start a reply are dropped, and a 0x05 inside a
+	 * frame is treated as an ack, so a noise byte can't hide the next ack.
+	 */
+	void setUploadMode(bool uploadMode) { this->uploadMode = uploadMode; reset(); }
+
+	bool getUploadMode() const { return uploadMode; }
+
+	/**
+	 * Processes one byte. Returns one of the TOKEN_ constants.
+	 */
+	int handleByte(uint8_t c);
+
+	/**
+	 * Reads available bytes from stream until a token completes or there is no more data.
+	 * Returns one of the TOKEN_ constants.
+	 */
+	int poll(Stream &stream);
+
+	/**
+	 * The last complete frame, without the 0xFF 0xFF 0xFF terminator. Valid until the next call
+	 * to handleByte() or poll().
+	 */
+	const uint8_t *getFrame() const { return frame; }
+
+	size_t getFrameLength() const { return frameLength; }
+
+	uint32_t getOffset() const { return offset; }
+
+	/**
+	 * Returns true if the last frame starts with the string prefix (for example "comok")
+	 */
+	bool frameStartsWith(const char *prefix) const;
+
+	/**
+	 * Returns true if the last frame is the startup frame (0x00 0x00 0x00) sent when the display boots
+	 */
+	bool isStartupFrame() const;
+
+	/**
+	 * Returns true if the last frame is the ready frame (0x88) sent when the display is ready after booting
+	 */
+	bool isReadyFrame() const;
+
+	/**
+	 * Returns true if code is a Nextion error reply code (invalid instruction, invalid variable, etc.)
+	 */
+	static bool isErrorCode(uint8_t code);
+
+protected:
+	static const int PARSE_START = 0;
+	static const int PARSE_FRAME = 1;
+	static const int PARSE_OFFSET = 2;
+
+	bool uploadMode = false;
+	int parseState = PARSE_START;
+	uint8_t frame[FRAME_BUFFER_SIZE];
+	size_t frameLength = 0;
+	size_t frameIndex = 0;
+	int ffCount = 0;
+	bool overflow = false;
+	uint32_t offset = 0;
+	int offsetCount = 0;
+};
+
+#endif /* __NEXTIONRESPONSEDECODER_H */
@@ -0,0 +1,66 @@
+#include "NextionTrace.h"
+
+NextionTrace::NextionTrace(size_t numRecords) {
+	records = (Record *) malloc(numRecords * sizeof(Record));
+	if (records != NULL) {
+		this->numRecords = numRecords;
+	}
+}
+
+NextionTrace::~NextionTrace() {
+	if (records != NULL) {
+		free(records);
+	}
+}
+
+void NextionTrace::record(uint8_t event, uint32_t value) {
+	if (numRecords == 0) {
+		return;
+	}
+
+	Record &rec = records[next];
+	rec.timeMs = millis();
+	rec.event = event;
+	rec.reserved[0] = rec.reserved[1] = rec.reserved[2] = 0;
+	rec.value = value;
+
+	if (++next >= numRecords) {
+		next = 0;
+	}
+	if (count < numRecords) {
+		count++;
+	}
+}
+
+void NextionTrace::clear() {
+	next = 0;
+	count = 0;
+}
+
+size_t NextionTrace::copyTo(uint8_t *buf, size_t bufSize) const {
+	size_t copied = 0;
+	size_t index = (next + numRecords - count) % (numRecords ? numRecords : 1);
+
+	for(size_t ii = 0; ii < count && (copied + sizeof(Record)) <= bufSize; ii++) {
+		memcpy(&buf[copied], &records[index], sizeof(Record));
+		copied += sizeof(Record);
+
+		if (++index >= numRecords) {
+			index = 0;
+		}
+	}
+	return copied;
+}
+
+void NextionTrace::dump(Print &out) const {
+	size_t index = (next + numRecords - count) % (numRecords ? numRecords : 1);
+
+	for(size_t ii = 0; ii < count; ii++) {
+		const Record &rec = records[index];
+		out.printf("%lu %u %lu\n", (unsigned long) rec.timeMs, rec.event, (unsigned long) rec.value);
+
+		if (++index >= numRecords) {
+			index = 0;
+		}
+	}
+}
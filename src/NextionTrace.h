@@ -0,0 +1,95 @@
+#ifndef __NEXTIONTRACE_H
+#define __NEXTIONTRACE_H
+
+#include "Particle.h"
+
+/**
+ * Fixed-size ring buffer of timestamped events recorded by NextionDownload. Attach one with
+ * NextionDownload::withTrace(). When full, the oldest events are overwritten.
+ *
+ * The events include everything the download reacts to (what the server and display sent, and when),
+ * so tools/nextion-replay can run a trace of a whole check back through NextionDownload on a computer
+ * and compare what it does with what was recorded. For that the trace must be attached before setup()
+ * or the check, and be large enough to hold the whole check (about 10 events per 4 Kbyte block).
+ *
+ * The binary format from copyTo() is an array of Record structures, oldest first, in the native
+ * (little endian) byte order.
+ */
+class NextionTrace {
+public:
+	struct Record {
+		uint32_t timeMs;
+		uint8_t event;
+		uint8_t reserved[3];
+		uint32_t value;
+	};
+
+	// Event codes
+	static const uint8_t EVENT_STATE = 1; 		// value is one of the STATE_ constants
+	static const uint8_t EVENT_TCP_READ = 2; 	// value is the number of bytes read
+	static const uint8_t EVENT_UART_WRITE = 3; 	// value is the number of bytes written
+	static const uint8_t EVENT_ACK = 4; 		// value is the ms since the last byte of the block was queued (or since switching to the download baud rate)
+	static const uint8_t EVENT_BAUD = 5; 		// value is the new baud rate
+	static const uint8_t EVENT_ERROR = 6; 		// value is the data offset when the error occurred
+	static const uint8_t EVENT_FRAME = 7; 		// value is the first byte of a reply frame from the display
+	static const uint8_t EVENT_DISPLAY_ERROR = 8; 	// value is the error code sent by the display
+	static const uint8_t EVENT_TCP_CONNECT = 9; 	// value is the connect time in ms, or CONNECT_FAILED
+	static const uint8_t EVENT_TCP_CLOSE = 10; 	// value is the data offset when the connection was closed or lost
+	static const uint8_t EVENT_HTTP_STATUS = 11; 	// value is the HTTP status code of the response
+	static const uint8_t EVENT_HTTP_HEADER = 12; 	// value is the length of the response header
+	static const uint8_t EVENT_HTTP_LENGTH = 13; 	// value is the Content-Length of the response
+	static const uint8_t EVENT_TCP_DISCONNECT = 14; // value is the data offset when the server closed the connection
+	static const uint8_t EVENT_CHECK = 15; 		// requestCheck() was called, value is forceDownload
+
+	static const uint32_t CONNECT_FAILED = 0xffffffff;
+
+	// State codes for EVENT_STATE
+	static const uint8_t STATE_START = 0;
+	static const uint8_t STATE_WAIT_CONNECT = 1;
+	static const uint8_t STATE_HEADER_WAIT = 2;
+	static const uint8_t STATE_DATA_WAIT = 3;
+	static const uint8_t STATE_SERIAL_WRITE = 4;
+	static const uint8_t STATE_ACK_WAIT = 5;
+	static const uint8_t STATE_RESTART_WAIT = 6;
+	static const uint8_t STATE_RETRY_WAIT = 7;
+	static const uint8_t STATE_CLEANUP = 8;
+	static const uint8_t STATE_DONE = 9;
+	static const uint8_t STATE_START_WAIT = 10;
+	static const uint8_t STATE_MANIFEST_WAIT = 11;
+	static const uint8_t STATE_SETUP = 12;		// setup() was called
+
+	/**
+	 * Allocates room for numRecords events. This is the only allocation; recording never allocates.
+	 */
+	NextionTrace(size_t numRecords);
+	virtual ~NextionTrace();
+
+	void record(uint8_t event, uint32_t value);
+
+	void clear();
+
+	/**
+	 * Returns the number of events currently held (at most getCapacity()).
+	 */
+	size_t getCount() const { return count; }
+
+	size_t getCapacity() const { return numRecords; }
+
+	/**
+	 * Copies the events, oldest first, as binary Record structures. Returns the number of bytes copied.
+	 */
+	size_t copyTo(uint8_t *buf, size_t bufSize) const;
+
+	/**
+	 * Writes the events, oldest first, one per line as "timeMs event value" in decimal.
+	 */
+	void dump(Print &out) const;
+
+protected:
+	Record *records = 0;
+	size_t numRecords = 0;
+	size_t next = 0;
+	size_t count = 0;
+};
+
+#endif /* __NEXTIONTRACE_H */
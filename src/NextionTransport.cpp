@@ -0,0 +1,64 @@
+#include "NextionTransport.h"
+
+bool NextionTransport::connectTo(const char *hostname, uint16_t port) {
+	connectedHostname = "";
+	connectedPort = 0;
+	if (!connect(hostname, port)) {
+		return false;
+	}
+	connectedHostname = hostname;
+	connectedPort = port;
+	return true;
+}
+
+bool NextionTransport::isConnectedTo(const char *hostname, uint16_t port) {
+	return connectedPort == port && connectedHostname.equals(hostname) && connected();
+}
+
+bool NextionTcpTransport::connect(const char *hostname, uint16_t port) {
+	DnsCacheEntry *cached = NULL;
+	for(size_t ii = 0; ii < DNS_CACHE_SIZE; ii++) {
+		if (dnsCache[ii].hostname.equals(hostname)) {
+			cached = &dnsCache[ii];
+			if (client.connect(cached->addr, port)) {
+				return true;
+			}
+			break;
+		}
+	}
+
+	IPAddress addr = resolve(hostname);
+	if (cached) {
+		// The address may have changed, but if it didn't the server is down and connecting again would
+		// just wait for another timeout
+		if (!addr || addr == cached->addr) {
+			return false;
+		}
+		cached->addr = addr;
+		return client.connect(addr, port) != 0;
+	}
+
+	if (!addr) {
+		// Let TCPClient report the failure (or succeed, if it can resolve it itself)
+		return client.connect(hostname, port) != 0;
+	}
+
+	DnsCacheEntry &entry = dnsCache[dnsCacheNext];
+	entry.hostname = hostname;
+	entry.addr = addr;
+	if (++dnsCacheNext >= DNS_CACHE_SIZE) {
+		dnsCacheNext = 0;
+	}
+
+	return client.connect(addr, port) != 0;
+}
+
+IPAddress NextionTcpTransport::resolve(const char *hostname) {
+#if Wiring_WiFi
+	return WiFi.resolve(hostname);
+#elif Wiring_Cellular
+	return Cellular.resolve(hostname);
+#else
+	return IPAddress();
+#endif
+}
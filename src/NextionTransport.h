@@ -0,0 +1,81 @@
+#ifndef __NEXTIONTRANSPORT_H
+#define __NEXTIONTRANSPORT_H
+
+#include "Particle.h"
+
+/**
+ * Connection used by NextionDownload to make the HTTP request. The default is NextionTcpTransport
+ * (plain TCP), and it's the only transport included: this library does not do HTTPS by itself. A
+ * transport can be shared by several NextionDownload objects, as NextionDownloadQueue does.
+ */
+class NextionTransport {
+public:
+	NextionTransport() {}
+	virtual ~NextionTransport() {}
+
+	virtual bool connect(const char *hostname, uint16_t port) = 0;
+
+	/**
+	 * Connects with connect() and remembers the server, for isConnectedTo()
+	 */
+	bool connectTo(const char *hostname, uint16_t port);
+
+	/**
+	 * Returns true if connected to the server last passed to connectTo(). A kept-alive connection
+	 * may only be reused for the same server.
+	 */
+	bool isConnectedTo(const char *hostname, uint16_t port);
+
+	virtual bool connected() = 0;
+
+	/**
+	 * Reads up to size bytes. Returns the number of bytes read, 0 or -1 if none are available.
+	 */
+	virtual int read(uint8_t *buf, size_t size) = 0;
+
+	virtual int write(const uint8_t *buf, size_t size) = 0;
+
+	virtual void stop() = 0;
+
+protected:
+	String connectedHostname;
+	uint16_t connectedPort = 0;
+};
+
+/**
+ * Plain TCP transport using TCPClient. The addresses of the last few hostnames are cached so
+ * reconnecting to a server or mirror doesn't need another DNS lookup.
+ */
+class NextionTcpTransport : public NextionTransport {
+public:
+	NextionTcpTransport() {}
+	virtual ~NextionTcpTransport() {}
+
+	virtual bool connect(const char *hostname, uint16_t port);
+
+	virtual bool connected() { return client.connected() != 0; }
+
+	virtual int read(uint8_t *buf, size_t size) { return client.read(buf, size); }
+
+	virtual int write(const uint8_t *buf, size_t size) { return (int) client.write(buf, size); }
+
+	virtual void stop() { client.stop(); }
+
+	TCPClient &getClient() { return client; }
+
+	static const size_t DNS_CACHE_SIZE = 4;
+
+protected:
+	IPAddress resolve(const char *hostname);
+
+	struct DnsCacheEntry {
+		String hostname;
+		IPAddress addr;
+	};
+
+	TCPClient client;
+	DnsCacheEntry dnsCache[DNS_CACHE_SIZE];
+	size_t dnsCacheNext = 0;
+};
+
+#endif /* __NEXTIONTRANSPORT_H */
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Flashes a test file to four emulated displays at once with nextion-flasher and checks that each
+# display received it intact. The displays start at 115200 baud so the baud rate has to be detected.
+# Then replays the trace of each port with nextion-replay.
+# Usage: check-flasher.sh [build directory]
+
+BUILD=${1:-build}
+TMP=$(mktemp -d)
+EMULATOR_PID=
+trap 'test -n "$EMULATOR_PID" && kill $EMULATOR_PID 2>/dev/null; rm -rf "$TMP"' EXIT
+
+md5() {
+	if command -v md5sum >/dev/null; then md5sum "$1" | cut -d' ' -f1; else command md5 -q "$1"; fi
+}
+
+# Not a multiple of the block size, with a model name near the start like a real TFT
+{ printf 'NX4832T035_011R'; head -c 300000 /dev/urandom; } > "$TMP/test.tft"
+SIZE=$(wc -c < "$TMP/test.tft" | tr -d ' ')
+MD5=$(md5 "$TMP/test.tft")
+
+"$BUILD/nextion-emulator" -n 4 -b 115200 -1 > "$TMP/emulator.out" &
+EMULATOR_PID=$!
+for ii in 1 2 3 4 5 6 7 8 9 10; do
+	test "$(wc -l < "$TMP/emulator.out")" -ge 4 && break
+	sleep 0.2
+done
+PORTS=$(head -n 4 "$TMP/emulator.out")
+
+"$BUILD/nextion-flasher" -b 921600 -i 1 -t "$TMP" "$TMP/test.tft" $PORTS || exit 1
+wait $EMULATOR_PID
+EMULATOR_PID=
+
+RESULT=0
+for port in $PORTS; do
+	if grep -q "^$port $SIZE $MD5\$" "$TMP/emulator.out"; then
+		echo "$port received $SIZE bytes, md5 $MD5"
+	else
+		echo "$port did not receive the file intact:"
+		grep "^$port " "$TMP/emulator.out"
+		RESULT=1
+	fi
+done
+
+for trace in "$TMP"/*.trace; do
+	echo "replaying $(basename "$trace")"
+	"$BUILD/nextion-replay" "$trace" || RESULT=1
+done
+exit $RESULT
@@ -0,0 +1,217 @@
+#include "Particle.h"
+
+#include <chrono>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+// macOS has SO_NOSIGPIPE instead
+#define MSG_NOSIGNAL 0
+#endif
+
+WiFiClass WiFi;
+EEPROMClass EEPROM;
+Logger Log;
+
+static bool clockSimulated = false;
+static unsigned long simulatedMs = 0;
+static thread_local std::string threadName;
+
+static unsigned long systemMillis() {
+	static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	return (unsigned long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long millis() {
+	if (clockSimulated) {
+		return simulatedMs;
+	}
+	// Wraps like the device's 32-bit millis()
+	return (uint32_t) systemMillis();
+}
+
+void delay(unsigned long ms) {
+	if (clockSimulated) {
+		simulatedMs += ms;
+		return;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// static
+void HostClock::setSimulated(unsigned long startMs) {
+	clockSimulated = true;
+	simulatedMs = startMs;
+}
+
+// static
+bool HostClock::isSimulated() {
+	return clockSimulated;
+}
+
+// static
+void HostClock::advance(unsigned long ms) {
+	simulatedMs += ms;
+}
+
+
+size_t Print::write(const uint8_t *buf, size_t size) {
+	size_t count = 0;
+	for(size_t ii = 0; ii < size; ii++) {
+		count += write(buf[ii]);
+	}
+	return count;
+}
+
+size_t Print::printf(const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		return 0;
+	}
+	if ((size_t) len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+	return write((const uint8_t *)buf, len);
+}
+
+
+int TCPClient::connect(const char *hostname, uint16_t port) {
+	IPAddress addr = WiFi.resolve(hostname);
+	if (!addr) {
+		return 0;
+	}
+	return connect(addr, port);
+}
+
+int TCPClient::connect(IPAddress ip, uint16_t port) {
+	stop();
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return 0;
+	}
+
+	struct sockaddr_in sa = {};
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(ip.raw());
+	if (::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		stop();
+		return 0;
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 1;
+}
+
+uint8_t TCPClient::connected() {
+	if (fd < 0) {
+		return 0;
+	}
+
+	// Like the device, still connected while there's data left to read after the server closed
+	uint8_t c;
+	ssize_t result = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (result > 0) {
+		return 1;
+	}
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 1;
+	}
+	return 0;
+}
+
+int TCPClient::available() {
+	if (fd < 0) {
+		return 0;
+	}
+	uint8_t buf[4096];
+	ssize_t result = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	return (result > 0) ? (int) result : 0;
+}
+
+int TCPClient::read(uint8_t *buf, size_t size) {
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t result = recv(fd, buf, size, MSG_DONTWAIT);
+	return (result > 0) ? (int) result : -1;
+}
+
+size_t TCPClient::write(const uint8_t *buf, size_t size) {
+	if (fd < 0) {
+		return 0;
+	}
+	size_t count = 0;
+	while(count < size) {
+		ssize_t result = send(fd, &buf[count], size - count, MSG_NOSIGNAL);
+		if (result <= 0) {
+			break;
+		}
+		count += result;
+	}
+	return count;
+}
+
+void TCPClient::stop() {
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+
+IPAddress WiFiClass::resolve(const char *hostname) {
+	struct addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *result = NULL;
+	if (getaddrinfo(hostname, NULL, &hints, &result) != 0 || result == NULL) {
+		return IPAddress();
+	}
+	uint32_t addr = ntohl(((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr);
+	freeaddrinfo(result);
+
+	return IPAddress((uint8_t)(addr >> 24), (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr);
+}
+
+
+void Logger::info(const char *fmt, ...) {
+	if (!enabled) {
+		return;
+	}
+
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (threadName.empty()) {
+		fprintf(stderr, "%010lu INFO: %s\n", millis(), buf);
+	}
+	else {
+		fprintf(stderr, "%010lu %s INFO: %s\n", millis(), threadName.c_str(), buf);
+	}
+}
+
+// static
+void Logger::setThreadName(const char *name) {
+	threadName = name ? name : "";
+}
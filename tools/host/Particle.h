@@ -0,0 +1,207 @@
+#ifndef __HOST_PARTICLE_H
+#define __HOST_PARTICLE_H
+
+// The part of the Particle Device OS API used by the library, implemented on POSIX so the library can be
+// built into the host tools (Linux and macOS). Only what the library and the tools use is here, and
+// it's not meant to be used by device code.
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <mutex>
+#include <string>
+
+#define Wiring_WiFi 1
+#define HAL_PLATFORM_FILESYSTEM 1
+
+unsigned long millis();
+void delay(unsigned long ms);
+
+/**
+ * The clock used by millis() and delay(). It's the system monotonic clock unless setSimulated() is
+ * called, which is used to replay a trace with the same timing it was recorded with.
+ */
+class HostClock {
+public:
+	/**
+	 * Use a simulated clock that starts at startMs and only changes when advance() or delay() is called
+	 */
+	static void setSimulated(unsigned long startMs);
+
+	static bool isSimulated();
+
+	static void advance(unsigned long ms);
+};
+
+class String {
+public:
+	String() {}
+	String(const char *cstr) : str(cstr ? cstr : "") {}
+
+	String &operator=(const char *cstr) { str = cstr ? cstr : ""; return *this; }
+
+	const char *c_str() const { return str.c_str(); }
+	unsigned int length() const { return (unsigned int) str.length(); }
+
+	bool equals(const char *cstr) const { return str == (cstr ? cstr : ""); }
+	bool equals(const String &s) const { return str == s.str; }
+
+protected:
+	std::string str;
+};
+
+class Print {
+public:
+	virtual ~Print() {}
+
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t size);
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+
+	size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+};
+
+/**
+ * A serial port. This one is never connected; the tools use subclasses (PosixSerial for a tty, or a
+ * simulated display).
+ */
+class USARTSerial : public Stream {
+public:
+	virtual void begin(unsigned long baud) { (void) baud; }
+
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+
+	virtual int availableForWrite() { return 0; }
+
+	using Print::write;
+	virtual size_t write(uint8_t c) { return write(&c, 1); }
+	virtual size_t write(const uint8_t *buf, size_t size) { (void) buf; return size; }
+};
+
+class IPAddress {
+public:
+	IPAddress() {}
+	IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) : addr(((uint32_t)b0 << 24) | ((uint32_t)b1 << 16) | ((uint32_t)b2 << 8) | b3) {}
+
+	operator bool() const { return addr != 0; }
+	bool operator==(const IPAddress &other) const { return addr == other.addr; }
+
+	/**
+	 * The address in host byte order
+	 */
+	uint32_t raw() const { return addr; }
+
+protected:
+	uint32_t addr = 0;
+};
+
+/**
+ * TCP connection using a POSIX socket. Reads don't block.
+ */
+class TCPClient {
+public:
+	TCPClient() {}
+	virtual ~TCPClient() { stop(); }
+
+	int connect(const char *hostname, uint16_t port);
+	int connect(IPAddress ip, uint16_t port);
+
+	uint8_t connected();
+
+	int available();
+	int read(uint8_t *buf, size_t size);
+	size_t write(const uint8_t *buf, size_t size);
+
+	void stop();
+
+protected:
+	int fd = -1;
+};
+
+class WiFiClass {
+public:
+	bool ready() { return isReady; }
+
+	/**
+	 * The network is always ready unless this is used to simulate waiting for it
+	 */
+	void setReady(bool ready) { isReady = ready; }
+
+	/**
+	 * Returns the first IPv4 address of hostname, or an empty address if it can't be resolved
+	 */
+	IPAddress resolve(const char *hostname);
+
+protected:
+	bool isReady = true;
+};
+extern WiFiClass WiFi;
+
+/**
+ * Emulated EEPROM in RAM, initialized to 0xff like erased flash. It's shared by all threads, so each
+ * NextionDownload in a process must use its own locations.
+ */
+class EEPROMClass {
+public:
+	static const size_t EEPROM_SIZE = 4096;
+
+	EEPROMClass() { memset(data, 0xff, sizeof(data)); }
+
+	template<typename T> T &get(int index, T &t) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (index >= 0 && (size_t) index + sizeof(T) <= EEPROM_SIZE) {
+			memcpy((void *)&t, &data[index], sizeof(T));
+		}
+		return t;
+	}
+
+	template<typename T> const T &put(int index, const T &t) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (index >= 0 && (size_t) index + sizeof(T) <= EEPROM_SIZE) {
+			memcpy(&data[index], (const void *)&t, sizeof(T));
+		}
+		return t;
+	}
+
+	size_t length() const { return EEPROM_SIZE; }
+
+protected:
+	uint8_t data[EEPROM_SIZE];
+	std::mutex mutex;
+};
+extern EEPROMClass EEPROM;
+
+/**
+ * Log messages go to stderr, prefixed with the time and the name set for the calling thread
+ */
+class Logger {
+public:
+	void info(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	void setEnabled(bool enabled) { this->enabled = enabled; }
+
+	/**
+	 * Sets a prefix (like the serial port) for messages logged by the calling thread
+	 */
+	static void setThreadName(const char *name);
+
+protected:
+	bool enabled = true;
+	std::mutex mutex;
+};
+extern Logger Log;
+
+#endif /* __HOST_PARTICLE_H */
@@ -0,0 +1,137 @@
+#include "PosixSerial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+static speed_t toSpeed(unsigned long baud) {
+	switch(baud) {
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+#ifdef B460800
+	case 460800: return B460800;
+#endif
+#ifdef B921600
+	case 921600: return B921600;
+#endif
+	default: return 0;
+	}
+}
+
+PosixSerial::PosixSerial(const char *path) : path(path) {
+}
+
+PosixSerial::~PosixSerial() {
+	close();
+}
+
+bool PosixSerial::open() {
+	close();
+
+	fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct termios tio;
+	if (tcgetattr(fd, &tio) != 0) {
+		close();
+		return false;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | PARENB);
+#ifdef CRTSCTS
+	tio.c_cflag &= ~CRTSCTS;
+#endif
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, B9600);
+	cfsetospeed(&tio, B9600);
+	if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+		close();
+		return false;
+	}
+	tcflush(fd, TCIOFLUSH);
+	readOffset = readLength = 0;
+	return true;
+}
+
+void PosixSerial::close() {
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+void PosixSerial::begin(unsigned long baud) {
+	speed_t speed = toSpeed(baud);
+	if (fd < 0 || speed == 0) {
+		Log.info("%s: can't set baud %lu", path.c_str(), baud);
+		return;
+	}
+
+	struct termios tio;
+	if (tcgetattr(fd, &tio) != 0) {
+		return;
+	}
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	// Like the device, bytes already written go out at the old rate
+	tcsetattr(fd, TCSADRAIN, &tio);
+}
+
+void PosixSerial::fillReadBuffer() {
+	if (readOffset < readLength || fd < 0) {
+		return;
+	}
+	ssize_t count = ::read(fd, readBuf, sizeof(readBuf));
+	readOffset = 0;
+	readLength = (count > 0) ? (size_t) count : 0;
+}
+
+int PosixSerial::available() {
+	fillReadBuffer();
+	return (int) (readLength - readOffset);
+}
+
+int PosixSerial::read() {
+	fillReadBuffer();
+	if (readOffset >= readLength) {
+		return -1;
+	}
+	return readBuf[readOffset++];
+}
+
+int PosixSerial::availableForWrite() {
+	if (fd < 0) {
+		return 0;
+	}
+	int queued = 0;
+	if (ioctl(fd, TIOCOUTQ, &queued) != 0) {
+		return 0;
+	}
+	return (queued < (int) TX_BUFFER_SIZE) ? (int) TX_BUFFER_SIZE - queued : 0;
+}
+
+size_t PosixSerial::write(const uint8_t *buf, size_t size) {
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t count = ::write(fd, buf, size);
+	return (count > 0) ? (size_t) count : 0;
+}
+
+// static
+bool PosixSerial::isSupportedBaud(unsigned long baud) {
+	return toSpeed(baud) != 0;
+}
@@ -0,0 +1,59 @@
+#ifndef __POSIXSERIAL_H
+#define __POSIXSERIAL_H
+
+#include "Particle.h"
+
+/**
+ * USARTSerial on a POSIX tty (a USB serial adapter like /dev/ttyUSB0, or a pseudo-terminal), 8N1 with
+ * no flow control. Reads and writes don't block, like the device's UART buffers.
+ */
+class PosixSerial : public USARTSerial {
+public:
+	PosixSerial(const char *path);
+	virtual ~PosixSerial();
+
+	/**
+	 * Opens the port. Returns false if it can't be opened or isn't a tty.
+	 */
+	bool open();
+
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+
+	const char *getPath() const { return path.c_str(); }
+
+	/**
+	 * Waits for anything already written to be sent, then changes the baud rate
+	 */
+	virtual void begin(unsigned long baud);
+
+	virtual int available();
+	virtual int read();
+
+	/**
+	 * Free space in the kernel's output queue, counted against TX_BUFFER_SIZE
+	 */
+	virtual int availableForWrite();
+
+	using USARTSerial::write;
+	virtual size_t write(const uint8_t *buf, size_t size);
+
+	/**
+	 * Returns true if baud is a rate the tty supports
+	 */
+	static bool isSupportedBaud(unsigned long baud);
+
+	static const size_t TX_BUFFER_SIZE = 4096;
+
+protected:
+	void fillReadBuffer();
+
+	std::string path;
+	int fd = -1;
+	uint8_t readBuf[256];
+	size_t readOffset = 0;
+	size_t readLength = 0;
+};
+
+#endif /* __POSIXSERIAL_H */
@@ -0,0 +1,364 @@
+// Measures the per-byte cost of the inner loops of the download path on a computer, and fails if any is
+// more than 20% slower than the baseline stored for this CPU in baselines.txt. Each benchmark calls the
+// same library code the download uses.
+//
+// Build with make -C tools (see tools/Makefile). make -C tools bench runs it.
+//
+// Usage:
+//   nextion-benchmark [-b baselines.txt] [-t percent] [-u]
+//
+// The results are in ns and CPU cycles (on x86, from the time stamp counter) per Kbyte of data
+// downloaded. Each benchmark is run several times and the fastest run counts, which filters out most
+// of the noise from other processes. On a shared machine (like a VM) the speed can also change for a few
+// seconds at a time, so a result over the threshold is measured again up to 3 times, a second apart,
+// before it counts as a regression, and -u stores the median of 5 measurements a second apart.
+//
+// Baselines are kept per CPU model since the times are only comparable on the same one. If there are
+// none for this CPU, the results are printed and the exit status is 0. -u stores the results as the
+// baselines for this CPU; do that for a change that is expected to affect performance, and commit the
+// file with the change. The exit status is 1 if anything is slower than the threshold (-t, default 20).
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+#include "NextionDownloadRK.h"
+
+static const int RUNS = 15;
+static const int CHECK_MEASUREMENTS = 4;
+static const int UPDATE_MEASUREMENTS = 5;
+static const int WARMUP_MS = 500;
+static const int PAUSE_MS = 1000; // Between measurements of the same benchmark
+static const int ITERATIONS = 20000;
+
+enum {
+	BENCH_HEADER_PARSE = 0,
+	BENCH_HEADER_DISCARD,
+	BENCH_ACK_SCAN,
+	BENCH_MD5_UPDATE,
+	BENCH_STATE_DISPATCH,
+	BENCH_COUNT
+};
+
+static const char * const benchNames[BENCH_COUNT] = {
+	"header-parse", "header-discard", "ack-scan", "md5-update", "state-dispatch"
+};
+
+static const char header[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Date: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+		"Server: Apache/2.4.18 (Ubuntu)\r\n"
+		"Last-Modified: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+		"ETag: \"3a2c1-522a29c5e4d40\"\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Content-Length: 238273\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"\r\n";
+
+static char block[NextionDownload::BUFFER_SIZE];
+static char scratch[NextionDownload::BUFFER_SIZE];
+static volatile uint32_t sink;
+
+struct Result {
+	double nsPerKB;
+	double cyclesPerKB;
+};
+
+static uint64_t cycleCounter() {
+#ifdef HAVE_CYCLE_COUNTER
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Runs one benchmark ITERATIONS times and returns the cost per 1024 bytes processed
+ */
+static Result runBench(int bench, NextionDownload &idleDownload) {
+	size_t bytesPerIteration = NextionDownload::BUFFER_SIZE;
+	// Static, so the results don't depend on where the stack is
+	static NextionResponseDecoder decoder;
+	static MD5_CTX md5Ctx;
+	static NextionDownload::ResponseHeader responseHeader;
+	static size_t headerLength;
+
+	decoder.setUploadMode(true);
+	MD5_Init(&md5Ctx);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t startCycles = cycleCounter();
+
+	for(int iter = 0; iter < ITERATIONS; iter++) {
+		switch(bench) {
+		case BENCH_HEADER_PARSE:
+			// The parse is done in place, so it needs a fresh copy each time
+			bytesPerIteration = sizeof(header) - 1;
+			memcpy(scratch, header, sizeof(header));
+			sink += NextionDownload::parseResponseHeader(scratch, headerLength, responseHeader);
+			break;
+
+		case BENCH_HEADER_DISCARD:
+			// Moving the data after the header to the start of the buffer
+			bytesPerIteration = sizeof(scratch) - (sizeof(header) - 1);
+			sink += NextionDownload::consumeBuffer(scratch, sizeof(scratch), sizeof(header) - 1);
+			break;
+
+		case BENCH_ACK_SCAN:
+			// What the display sends for each block during an upload is the 0x05 ack, and the decoder is
+			// reset before each block is sent, so this is the ack cost per block of data
+			decoder.reset();
+			sink += decoder.handleByte(0x05);
+			break;
+
+		case BENCH_MD5_UPDATE:
+			MD5_Update(&md5Ctx, block, sizeof(block));
+			break;
+
+		case BENCH_STATE_DISPATCH:
+			// One loop() call per app loop when idle; reported per 1024 calls
+			for(size_t ii = 0; ii < 1024; ii++) {
+				idleDownload.loop();
+			}
+			bytesPerIteration = 1024;
+			break;
+		}
+	}
+
+	uint64_t cycles = cycleCounter() - startCycles;
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	Result result;
+	result.nsPerKB = (double) ns * 1024 / ((double) bytesPerIteration * ITERATIONS);
+	result.cyclesPerKB = (double) cycles * 1024 / ((double) bytesPerIteration * ITERATIONS);
+	return result;
+}
+
+/**
+ * Returns the fastest of RUNS runs of a benchmark
+ */
+static Result measure(int bench, NextionDownload &idleDownload) {
+	Result best = runBench(bench, idleDownload);
+	for(int run = 1; run < RUNS; run++) {
+		Result result = runBench(bench, idleDownload);
+		if (result.nsPerKB < best.nsPerKB) {
+			best = result;
+		}
+	}
+	return best;
+}
+
+static std::string cpuName() {
+	std::string name = "unknown";
+	FILE *fp = fopen("/proc/cpuinfo", "r");
+	if (fp) {
+		char line[256];
+		while(fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, "model name", 10) == 0 && strchr(line, ':')) {
+				name = strchr(line, ':') + 2;
+				name.erase(name.find_last_not_of("\r\n") + 1);
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	else {
+		// macOS
+		fp = popen("sysctl -n machdep.cpu.brand_string 2>/dev/null", "r");
+		if (fp) {
+			char line[256];
+			if (fgets(line, sizeof(line), fp)) {
+				name = line;
+				name.erase(name.find_last_not_of("\r\n") + 1);
+			}
+			pclose(fp);
+		}
+	}
+	return name;
+}
+
+/**
+ * Reads the baselines file. Lines are "cpu<tab>benchmark<tab>nsPerKB"; # starts a comment.
+ */
+static std::vector<std::string> readLines(const char *path) {
+	std::vector<std::string> lines;
+	FILE *fp = fopen(path, "r");
+	if (fp) {
+		char line[512];
+		while(fgets(line, sizeof(line), fp)) {
+			std::string s = line;
+			s.erase(s.find_last_not_of("\r\n") + 1);
+			lines.push_back(s);
+		}
+		fclose(fp);
+	}
+	return lines;
+}
+
+static bool parseLine(const std::string &line, std::string &cpu, std::string &bench, double &nsPerKB) {
+	if (line.empty() || line[0] == '#') {
+		return false;
+	}
+	size_t tab1 = line.find('\t');
+	size_t tab2 = (tab1 != std::string::npos) ? line.find('\t', tab1 + 1) : std::string::npos;
+	if (tab2 == std::string::npos) {
+		return false;
+	}
+	cpu = line.substr(0, tab1);
+	bench = line.substr(tab1 + 1, tab2 - tab1 - 1);
+	nsPerKB = strtod(line.c_str() + tab2 + 1, NULL);
+	return true;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-b baselines.txt] [-t percent] [-u]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	const char *baselinePath = "nextion-benchmark/baselines.txt";
+	int thresholdPercent = 20;
+	bool update = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "b:t:u")) != -1) {
+		switch(opt) {
+		case 'b':
+			baselinePath = optarg;
+			break;
+		case 't':
+			thresholdPercent = atoi(optarg);
+			break;
+		case 'u':
+			update = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	Log.setEnabled(false);
+
+	// Representative TFT data without 0x05, 0x08 or 0xFF terminators
+	for(size_t ii = 0; ii < sizeof(block); ii++) {
+		block[ii] = (char) (0x10 + (ii * 7) % 0xe0);
+	}
+
+	// Never checks, so loop() stays in the done state
+	USARTSerial serial;
+	NextionDownload idleDownload(serial, 0);
+	idleDownload.withCheckModeManual();
+	idleDownload.loop();
+
+	std::string cpu = cpuName();
+	std::vector<std::string> lines = readLines(baselinePath);
+	double baselines[BENCH_COUNT] = {0};
+	for(const std::string &line : lines) {
+		std::string lineCpu, lineBench;
+		double nsPerKB;
+		if (parseLine(line, lineCpu, lineBench, nsPerKB) && lineCpu == cpu) {
+			for(int bench = 0; bench < BENCH_COUNT; bench++) {
+				if (lineBench == benchNames[bench]) {
+					baselines[bench] = nsPerKB;
+				}
+			}
+		}
+	}
+
+	printf("%s\n", cpu.c_str());
+
+	// Gives the CPU time to reach its full clock rate
+	std::chrono::steady_clock::time_point warmupStart = std::chrono::steady_clock::now();
+	while(std::chrono::steady_clock::now() - warmupStart < std::chrono::milliseconds(WARMUP_MS)) {
+		runBench(BENCH_MD5_UPDATE, idleDownload);
+	}
+
+	Result results[BENCH_COUNT];
+	int failures = 0;
+	bool haveBaselines = false;
+	for(int bench = 0; bench < BENCH_COUNT; bench++) {
+		Result best;
+		if (update) {
+			// The baseline is the median of several measurements, so it isn't a lucky one
+			std::vector<Result> measured;
+			for(int ii = 0; ii < UPDATE_MEASUREMENTS; ii++) {
+				if (ii > 0) {
+					usleep(PAUSE_MS * 1000);
+				}
+				measured.push_back(measure(bench, idleDownload));
+			}
+			std::sort(measured.begin(), measured.end(), [](const Result &a, const Result &b) { return a.nsPerKB < b.nsPerKB; });
+			best = measured[UPDATE_MEASUREMENTS / 2];
+		}
+		else {
+			// A regression is slow every time, so measure again before calling it one
+			best = measure(bench, idleDownload);
+			for(int ii = 1; ii < CHECK_MEASUREMENTS && baselines[bench] != 0 &&
+					best.nsPerKB > baselines[bench] * (100 + thresholdPercent) / 100; ii++) {
+				usleep(PAUSE_MS * 1000);
+				Result result = measure(bench, idleDownload);
+				if (result.nsPerKB < best.nsPerKB) {
+					best = result;
+				}
+			}
+		}
+		results[bench] = best;
+
+		char cyclesStr[32] = "";
+#ifdef HAVE_CYCLE_COUNTER
+		snprintf(cyclesStr, sizeof(cyclesStr), "%10.1f cycles/KB", best.cyclesPerKB);
+#endif
+		printf("%-15s %10.3f ns/KB %8.4f ns/byte %s", benchNames[bench], best.nsPerKB, best.nsPerKB / 1024, cyclesStr);
+
+		if (baselines[bench] != 0 && !update) {
+			haveBaselines = true;
+			bool pass = (best.nsPerKB <= baselines[bench] * (100 + thresholdPercent) / 100);
+			if (!pass) {
+				failures++;
+			}
+			printf("  baseline %10.3f %s", baselines[bench], pass ? "PASS" : "FAIL");
+		}
+		printf("\n");
+	}
+
+	if (update) {
+		// Replace the lines for this CPU, keeping the others
+		FILE *fp = fopen(baselinePath, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "could not write %s\n", baselinePath);
+			return 1;
+		}
+		for(const std::string &line : lines) {
+			std::string lineCpu, lineBench;
+			double nsPerKB;
+			if (!parseLine(line, lineCpu, lineBench, nsPerKB) || lineCpu != cpu) {
+				fprintf(fp, "%s\n", line.c_str());
+			}
+		}
+		for(int bench = 0; bench < BENCH_COUNT; bench++) {
+			fprintf(fp, "%s\t%s\t%.3f\n", cpu.c_str(), benchNames[bench], results[bench].nsPerKB);
+		}
+		fclose(fp);
+		printf("baselines for this CPU written to %s\n", baselinePath);
+		return 0;
+	}
+
+	if (!haveBaselines) {
+		printf("no baselines for this CPU in %s; run with -u to store these\n", baselinePath);
+		return 0;
+	}
+	printf("%d regressions over %d%%\n", failures, thresholdPercent);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,369 @@
+// Emulates Nextion displays on pseudo-terminals, for testing nextion-flasher and the library's upload
+// protocol without hardware.
+//
+// Build with make -C tools (see tools/Makefile).
+//
+// Usage:
+//   nextion-emulator [-n count] [-b baud] [-l ackLatencyMs] [-m model] [-1]
+//
+// Creates count displays (default 1) and prints the pseudo-terminal path of each on stdout, one per
+// line, then runs until killed. Open the path as a serial port. When an upload completes, a line
+//   <path> <size> <md5>
+// is printed with the md5 of the data received, to compare with md5sum of the .tft file. With -1 the
+// emulator exits once every display has received one upload.
+//
+// Each display:
+//   - only understands bytes sent at its current baud rate (the sender's rate is the termios setting of
+//     the pseudo-terminal), starting at -b (default 9600); anything else is dropped as garbled
+//   - reads no faster than the baud rate allows (10 bits per byte), so the pseudo-terminal fills up like
+//     a UART
+//   - answers connect with a comok frame for model (default NX4832T035_011R) and other commands with
+//     error 0x1A
+//   - on whmi-wri size,baud,0 switches to baud and sends 0x05 after START_ACK_DELAY_MS, then sends 0x05
+//     ackLatencyMs (default 20) after each 4096 bytes and after the last partial block
+//   - after the last block, restarts at its original baud rate, sending the startup frame 00 00 00 and
+//     then the ready frame 0x88
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "md5.h"
+
+static const size_t BLOCK_SIZE = 4096; // Upload block size, acknowledged with 0x05
+static const unsigned long START_ACK_DELAY_MS = 100; // whmi-wri to 0x05, after changing baud rate
+static const unsigned long RESTART_DELAY_MS = 300; // Last ack to the startup frame
+static const unsigned long READY_DELAY_MS = 200; // Startup frame to the ready frame
+
+static unsigned long nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static speed_t toSpeed(unsigned long baud) {
+	switch(baud) {
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+#ifdef B460800
+	case 460800: return B460800;
+#endif
+#ifdef B921600
+	case 921600: return B921600;
+#endif
+	default: return 0;
+	}
+}
+
+struct Output {
+	unsigned long dueMs;
+	std::string bytes;
+	unsigned long baud; // Changes the display's baud rate before sending, if not 0
+	bool upload;		// The mode after sending
+};
+
+class Display {
+public:
+	bool open(unsigned long baud, unsigned long ackLatencyMs, const char *model);
+
+	void process(unsigned long now);
+
+	const char *getPath() const { return path.c_str(); }
+
+	int getFd() const { return masterFd; }
+
+	size_t getUploadCount() const { return uploadCount; }
+
+protected:
+	bool hostBaudMatches();
+	void handleCommand(unsigned long now);
+	void handleUpload(const uint8_t *buf, size_t size, unsigned long now);
+	void send(unsigned long dueMs, const std::string &bytes, unsigned long baud = 0) {
+		bool nextUpload = output.empty() ? upload : output.back().upload;
+		output.push_back(Output{dueMs, bytes, baud, nextUpload});
+	}
+
+	int masterFd = -1;
+	int slaveFd = -1;
+	std::string path;
+	std::string model;
+	unsigned long displayBaud = 9600; // Rate after a restart
+	unsigned long baud = 9600;
+	unsigned long ackLatencyMs = 20;
+	unsigned long readTime = 0;
+	double readCredit = 0;
+
+	bool upload = false;
+	std::string command;
+	size_t uploadSize = 0;
+	size_t received = 0;
+	size_t blockFill = 0;
+	MD5_CTX md5Ctx;
+	size_t uploadCount = 0;
+
+	std::deque<Output> output;
+};
+
+bool Display::open(unsigned long baud, unsigned long ackLatencyMs, const char *model) {
+	masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (masterFd < 0 || grantpt(masterFd) != 0 || unlockpt(masterFd) != 0) {
+		return false;
+	}
+	path = ptsname(masterFd);
+
+	// Holding the other side open keeps the master readable (instead of EIO) between clients
+	slaveFd = ::open(path.c_str(), O_RDWR | O_NOCTTY);
+	if (slaveFd < 0) {
+		return false;
+	}
+	struct termios tio;
+	tcgetattr(slaveFd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slaveFd, TCSANOW, &tio);
+
+	fcntl(masterFd, F_SETFL, fcntl(masterFd, F_GETFL) | O_NONBLOCK);
+
+	this->displayBaud = this->baud = baud;
+	this->ackLatencyMs = ackLatencyMs;
+	this->model = model;
+	readTime = nowMs();
+	return true;
+}
+
+bool Display::hostBaudMatches() {
+	struct termios tio;
+	if (tcgetattr(masterFd, &tio) != 0) {
+		return false;
+	}
+	return cfgetospeed(&tio) == toSpeed(baud);
+}
+
+void Display::process(unsigned long now) {
+	// Send replies that are due. While the rates differ the host can only receive garbage, so drop them.
+	while(!output.empty() && (long)(now - output.front().dueMs) >= 0) {
+		Output &out = output.front();
+		if (out.baud != 0) {
+			baud = out.baud;
+		}
+		if (hostBaudMatches()) {
+			if (write(masterFd, out.bytes.data(), out.bytes.size()) < 0) {
+				// Nobody is reading, the reply is lost like on a disconnected display
+			}
+		}
+		upload = out.upload;
+		output.pop_front();
+	}
+
+	// Receive at no more than the baud rate, with about 10 ms of buffering
+	double maxCredit = (double) baud / 1000;
+	if (maxCredit < 64) {
+		maxCredit = 64;
+	}
+	readCredit += (double)(now - readTime) * baud / 10000;
+	readTime = now;
+	if (readCredit > maxCredit) {
+		readCredit = maxCredit;
+	}
+	if (readCredit < 1) {
+		return;
+	}
+
+	uint8_t buf[4096];
+	size_t requestSize = (size_t) readCredit;
+	if (requestSize > sizeof(buf)) {
+		requestSize = sizeof(buf);
+	}
+	ssize_t count = read(masterFd, buf, requestSize);
+	if (count <= 0) {
+		return;
+	}
+	readCredit -= count;
+
+	if (!hostBaudMatches()) {
+		// Garbled
+		return;
+	}
+
+	if (upload) {
+		handleUpload(buf, count, now);
+		return;
+	}
+
+	for(ssize_t ii = 0; ii < count; ii++) {
+		command += (char) buf[ii];
+		size_t len = command.size();
+		if (len >= 3 && (uint8_t)command[len - 1] == 0xff && (uint8_t)command[len - 2] == 0xff && (uint8_t)command[len - 3] == 0xff) {
+			command.resize(len - 3);
+			handleCommand(now);
+			command.clear();
+
+			if (!output.empty() && output.back().upload) {
+				// The rest is data at the new rate, which can't have been sent at this one
+				break;
+			}
+		}
+	}
+}
+
+void Display::handleCommand(unsigned long now) {
+	static const std::string terminator("\xff\xff\xff", 3);
+
+	if (command == "connect") {
+		send(now + 5, "comok 1,30601-0," + model + ",52,61488,D264B8204F0E1828,16777216" + terminator);
+		return;
+	}
+
+	unsigned long size, newBaud;
+	if (sscanf(command.c_str(), "whmi-wri %lu,%lu,", &size, &newBaud) == 2) {
+		if (toSpeed(newBaud) == 0) {
+			send(now + 5, std::string("\x11", 1) + terminator);
+			return;
+		}
+		uploadSize = size;
+		received = 0;
+		blockFill = 0;
+		MD5_Init(&md5Ctx);
+
+		// Switch right away, then acknowledge at the new rate once the host has switched too
+		output.push_back(Output{now, std::string(), newBaud, true});
+		send(now + START_ACK_DELAY_MS, "\x05");
+		return;
+	}
+
+	// Anything else (including the empty command sent to clear the display's buffer) is an error
+	send(now + 5, std::string("\x1a", 1) + terminator);
+}
+
+void Display::handleUpload(const uint8_t *buf, size_t size, unsigned long now) {
+	static const std::string terminator("\xff\xff\xff", 3);
+
+	while(size > 0 && received < uploadSize) {
+		size_t count = BLOCK_SIZE - blockFill;
+		if (count > size) {
+			count = size;
+		}
+		if (count > uploadSize - received) {
+			count = uploadSize - received;
+		}
+		MD5_Update(&md5Ctx, buf, count);
+		buf += count;
+		size -= count;
+		received += count;
+		blockFill += count;
+
+		if (blockFill == BLOCK_SIZE || received == uploadSize) {
+			blockFill = 0;
+			send(now + ackLatencyMs, "\x05");
+		}
+	}
+
+	if (received == uploadSize && output.back().upload) {
+		unsigned char out[16];
+		MD5_Final(out, &md5Ctx);
+		printf("%s %lu ", path.c_str(), (unsigned long) received);
+		for(size_t ii = 0; ii < sizeof(out); ii++) {
+			printf("%02x", out[ii]);
+		}
+		printf("\n");
+		fflush(stdout);
+		uploadCount++;
+
+		// Restart at the normal baud rate
+		unsigned long restartMs = now + ackLatencyMs + RESTART_DELAY_MS;
+		output.push_back(Output{restartMs, std::string("\x00\x00\x00", 3) + terminator, displayBaud, false});
+		send(restartMs + READY_DELAY_MS, std::string("\x88", 1) + terminator);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t numDisplays = 1;
+	unsigned long baud = 9600;
+	unsigned long ackLatencyMs = 20;
+	const char *model = "NX4832T035_011R";
+	bool once = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:b:l:m:1")) != -1) {
+		switch(opt) {
+		case 'n':
+			numDisplays = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			baud = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			ackLatencyMs = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			model = optarg;
+			break;
+		case '1':
+			once = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n count] [-b baud] [-l ackLatencyMs] [-m model] [-1]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (numDisplays == 0 || toSpeed(baud) == 0) {
+		fprintf(stderr, "invalid count or baud rate\n");
+		return 2;
+	}
+
+	std::vector<Display> displays(numDisplays);
+	for(Display &display : displays) {
+		if (!display.open(baud, ackLatencyMs, model)) {
+			fprintf(stderr, "could not create a pseudo-terminal: %s\n", strerror(errno));
+			return 1;
+		}
+		printf("%s\n", display.getPath());
+	}
+	fflush(stdout);
+
+	std::vector<struct pollfd> fds(numDisplays);
+	while(true) {
+		for(size_t ii = 0; ii < numDisplays; ii++) {
+			fds[ii].fd = displays[ii].getFd();
+			fds[ii].events = POLLIN;
+		}
+		// Wake up every ms for replies and the receive rate limit
+		poll(fds.data(), fds.size(), 1);
+
+		unsigned long now = nowMs();
+		bool allDone = true;
+		for(Display &display : displays) {
+			display.process(now);
+			if (display.getUploadCount() == 0) {
+				allDone = false;
+			}
+		}
+		if (once && allDone) {
+			// Let the restart frames go out
+			unsigned long endMs = now + RESTART_DELAY_MS + READY_DELAY_MS + ackLatencyMs + 100;
+			while((long)(nowMs() - endMs) < 0) {
+				poll(NULL, 0, 1);
+				for(Display &display : displays) {
+					display.process(nowMs());
+				}
+			}
+			break;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,472 @@
+// Compares the coroutine download engine (NextionCoDownload) with the state machine (NextionDownload):
+// the cost of a loop() call, and how many transfers one thread can run at once.
+//
+// Build with make -C tools (see tools/Makefile). It needs a compiler with C++20 coroutines.
+//
+// Usage:
+//   nextion-engine-bench [-n counts] [-s size] [-b baud] [-l ackLatencyMs]
+//
+// For each number of transfers in counts (comma separated, default 1,10,100,1000), that many
+// downloads of a size byte file (default 66770) are run at the same time from one thread with each
+// engine, on a simulated clock. Each transfer has its own simulated server and display. loop() is
+// called for every transfer once per simulated ms, like an app loop that runs each download in turn.
+// The display clocks the data in at baud (default 921600) through a 128 byte TX buffer and
+// acknowledges each block ackLatencyMs (default 20) after its last byte. The display answers
+// commands right away, since the state machine's baud rate probe busy-waits on millis().
+//
+// For each engine and count it prints:
+//   - ns per loop() call, averaged over the transfer (including the simulated display and server,
+//     which are the same for both engines)
+//   - CPU time per simulated second for all of the transfers, and from that how many transfers this
+//     computer could run in real time from one thread
+//   - memory per transfer: the object and its buffer, plus the coroutine frames in use
+//   - whether every display received the file intact
+//
+// Then it prints the cost of a loop() call while each engine waits for a block ack, without the
+// simulated display clocking in data, which is the engine's own per-loop overhead.
+//
+// The exit status is 1 if any transfer failed.
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "NextionCoDownload.h"
+
+static const size_t TX_BUFFER_SIZE = 128;
+static const unsigned long START_ACK_DELAY_MS = 60; // After whmi-wri, once the host has changed baud
+static const unsigned long RESTART_STARTUP_MS = 300;
+static const unsigned long RESTART_READY_MS = 500;
+static const unsigned long TIME_LIMIT_MS = 600000;
+
+static std::vector<uint8_t> fileData;
+static unsigned long downloadBaud = 921600;
+static unsigned long ackLatencyMs = 20;
+
+/**
+ * Simulated display. It answers connect and whmi-wri, and in upload mode clocks in the data at the
+ * baud rate and acknowledges each block.
+ */
+class SimDisplay : public USARTSerial {
+public:
+	virtual void begin(unsigned long baud) {
+		drain();
+		hostBaud = baud;
+	}
+
+	virtual int available() {
+		drain();
+		deliver();
+		return (int) (rx.size() - rxOffset);
+	}
+
+	virtual int read() {
+		drain();
+		deliver();
+		if (rxOffset >= rx.size()) {
+			return -1;
+		}
+		return (uint8_t) rx[rxOffset++];
+	}
+
+	virtual int availableForWrite() {
+		drain();
+		return (int) (TX_BUFFER_SIZE - txPending);
+	}
+
+	using USARTSerial::write;
+	virtual size_t write(const uint8_t *buf, size_t size) {
+		if (!uploadMode) {
+			// Commands are handled right away
+			for(size_t ii = 0; ii < size; ii++) {
+				handleCommandByte(buf[ii]);
+			}
+			return size;
+		}
+
+		drain();
+		if (size > TX_BUFFER_SIZE - txPending) {
+			size = TX_BUFFER_SIZE - txPending;
+		}
+		if (written + size > uploadSize) {
+			size = uploadSize - written;
+		}
+		MD5_Update(&md5Ctx, buf, size);
+		written += size;
+		txPending += size;
+		return size;
+	}
+
+	size_t getReceived() const { return received; }
+
+	bool receivedIntact() const { return received == fileData.size() && md5Matches; }
+
+protected:
+	void reply(unsigned long delayMs, const std::string &bytes) {
+		replies.push_back(Reply{millis() + delayMs, bytes});
+	}
+
+	void deliver() {
+		if (rxOffset == rx.size()) {
+			rx.clear();
+			rxOffset = 0;
+		}
+		while(!replies.empty() && (long)(millis() - replies[0].dueMs) >= 0) {
+			rx += replies[0].bytes;
+			replies.erase(replies.begin());
+		}
+	}
+
+	void handleCommandByte(uint8_t c) {
+		static const std::string terminator("\xff\xff\xff", 3);
+
+		if (c != 0xff) {
+			command += (char) c;
+			ffCount = 0;
+			return;
+		}
+		if (++ffCount < 3) {
+			return;
+		}
+		ffCount = 0;
+
+		if (command == "connect") {
+			reply(0, "comok 1,30601-0,NX4832T035_011R,52,61488,D264B8204F0E1828,16777216" + terminator);
+		}
+		else
+		if (command.compare(0, 9, "whmi-wri ") == 0) {
+			uploadSize = strtoul(command.c_str() + 9, NULL, 10);
+			uploadMode = true;
+			written = received = txPending = 0;
+			md5Matches = false;
+			lastDrainMs = millis() + START_ACK_DELAY_MS;
+			MD5_Init(&md5Ctx);
+			reply(START_ACK_DELAY_MS, "\x05");
+		}
+		else {
+			reply(0, "\x1a" + terminator);
+		}
+		command.clear();
+	}
+
+	void drain() {
+		if (!uploadMode || (long)(millis() - lastDrainMs) <= 0) {
+			return;
+		}
+		// 10 bits per byte
+		credit += (double)(millis() - lastDrainMs) * hostBaud / 10000;
+		lastDrainMs = millis();
+		size_t count = (size_t) credit;
+		if (count > txPending) {
+			count = txPending;
+		}
+		credit = (count == txPending) ? 0 : credit - count;
+		// One ack for each block completed, including a short last block
+		size_t blocksBefore = received / NextionDownload::BUFFER_SIZE;
+		received += count;
+		txPending -= count;
+		for(size_t ii = blocksBefore; ii < received / NextionDownload::BUFFER_SIZE; ii++) {
+			reply(ackLatencyMs, "\x05");
+		}
+		if (count > 0 && received == uploadSize && uploadSize % NextionDownload::BUFFER_SIZE != 0) {
+			reply(ackLatencyMs, "\x05");
+		}
+
+		if (received == uploadSize) {
+			// Restart like a display does after a download
+			unsigned char md5[16], expected[16];
+			MD5_Final(md5, &md5Ctx);
+			MD5_CTX ctx;
+			MD5_Init(&ctx);
+			MD5_Update(&ctx, fileData.data(), fileData.size());
+			MD5_Final(expected, &ctx);
+			md5Matches = (memcmp(md5, expected, sizeof(md5)) == 0) && hostBaud == downloadBaud;
+
+			uploadMode = false;
+			reply(ackLatencyMs + RESTART_STARTUP_MS, std::string("\x00\x00\x00\xff\xff\xff", 6));
+			reply(ackLatencyMs + RESTART_READY_MS, std::string("\x88\xff\xff\xff", 4));
+		}
+	}
+
+	struct Reply {
+		unsigned long dueMs;
+		std::string bytes;
+	};
+
+	unsigned long hostBaud = 9600;
+	std::string command;
+	int ffCount = 0;
+	std::vector<Reply> replies;
+	std::string rx;
+	size_t rxOffset = 0;
+
+	bool uploadMode = false;
+	size_t uploadSize = 0;
+	size_t written = 0;
+	size_t received = 0;
+	size_t txPending = 0;
+	unsigned long lastDrainMs = 0;
+	double credit = 0;
+	MD5_CTX md5Ctx;
+	bool md5Matches = false;
+};
+
+/**
+ * Simulated server that sends the file as fast as it's read
+ */
+class SimServer : public NextionTransport {
+public:
+	virtual bool connect(const char *hostname, uint16_t port) {
+		isConnected = true;
+		request.clear();
+		header.clear();
+		offset = 0;
+		return true;
+	}
+
+	virtual bool connected() { return isConnected; }
+
+	virtual int read(uint8_t *buf, size_t size) {
+		if (header.empty()) {
+			return -1;
+		}
+		size_t total = header.size() + fileData.size();
+		size_t count = 0;
+		while(count < size && offset < total) {
+			buf[count++] = (offset < header.size()) ? (uint8_t) header[offset] : fileData[offset - header.size()];
+			offset++;
+		}
+		return (count > 0) ? (int) count : -1;
+	}
+
+	virtual int write(const uint8_t *buf, size_t size) {
+		request.append((const char *)buf, size);
+		if (request.find("\r\n\r\n") != std::string::npos) {
+			header = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(fileData.size()) + "\r\n\r\n";
+		}
+		return (int) size;
+	}
+
+	virtual void stop() { isConnected = false; }
+
+protected:
+	bool isConnected = false;
+	std::string request;
+	std::string header;
+	size_t offset = 0;
+};
+
+struct Result {
+	size_t numOk = 0;
+	uint64_t numLoops = 0;
+	uint64_t cpuNs = 0;
+	unsigned long simulatedMs = 0;
+	size_t bytesPerTransfer = 0;
+};
+
+template<class Engine> Engine *makeEngine(SimDisplay &display, SimServer &server);
+
+template<>
+NextionDownload *makeEngine<NextionDownload>(SimDisplay &display, SimServer &server) {
+	NextionDownload *download = new NextionDownload(display, 0);
+	download->withTransport(server)
+		.withHostname("localhost")
+		.withPathPartOfUrl("/bench.tft")
+		.withCheckModeManual()
+		.withDownloadBaud(downloadBaud);
+	return download;
+}
+
+template<>
+NextionCoDownload *makeEngine<NextionCoDownload>(SimDisplay &display, SimServer &server) {
+	NextionCoDownload *download = new NextionCoDownload(display);
+	download->withTransport(server)
+		.withHostname("localhost")
+		.withPathPartOfUrl("/bench.tft")
+		.withDownloadBaud(downloadBaud);
+	return download;
+}
+
+static void startEngine(NextionDownload &download) { download.requestCheck(true); }
+static void startEngine(NextionCoDownload &download) { download.requestCheck(); }
+
+/**
+ * Runs count transfers at once with Engine (NextionDownload or NextionCoDownload)
+ */
+template<class Engine>
+static Result runTransfers(size_t count) {
+	HostClock::setSimulated(0);
+
+	std::vector<std::unique_ptr<SimDisplay>> displays;
+	std::vector<std::unique_ptr<SimServer>> servers;
+	std::vector<std::unique_ptr<Engine>> engines;
+	for(size_t ii = 0; ii < count; ii++) {
+		displays.emplace_back(new SimDisplay());
+		servers.emplace_back(new SimServer());
+		engines.emplace_back(makeEngine<Engine>(*displays[ii], *servers[ii]));
+	}
+
+	Result result;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	size_t framesFree = NextionFramePool::getNumFree();
+	size_t framesUsedMax = 0;
+	for(auto &engine : engines) {
+		startEngine(*engine);
+	}
+
+	size_t numDone = 0;
+	while(numDone < count && millis() < TIME_LIMIT_MS) {
+		if (framesFree - NextionFramePool::getNumFree() > framesUsedMax) {
+			framesUsedMax = framesFree - NextionFramePool::getNumFree();
+		}
+
+		numDone = 0;
+		for(auto &engine : engines) {
+			engine->loop();
+			if (engine->getIsDone()) {
+				numDone++;
+			}
+		}
+		result.numLoops += count;
+		HostClock::advance(1);
+	}
+
+	result.cpuNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	result.simulatedMs = millis();
+	for(size_t ii = 0; ii < count; ii++) {
+		if (displays[ii]->receivedIntact()) {
+			result.numOk++;
+		}
+	}
+	result.bytesPerTransfer = sizeof(Engine) + NextionDownload::BUFFER_SIZE;
+	if (std::is_same<Engine, NextionCoDownload>::value) {
+		result.bytesPerTransfer += (framesUsedMax * NextionFramePool::FRAME_SIZE + count - 1) / count;
+	}
+	return result;
+}
+
+/**
+ * ns per loop() call while Engine waits for the ack for the first block, which is what loop() is doing
+ * most of the time. The display doesn't ack, and the clock doesn't move while it's measured, so this is
+ * only the engine's dispatch and polling of the serial port.
+ */
+template<class Engine>
+static double measureWaitingLoop() {
+	static const size_t ITERATIONS = 2000000;
+
+	unsigned long savedLatencyMs = ackLatencyMs;
+	ackLatencyMs = TIME_LIMIT_MS;
+	HostClock::setSimulated(0);
+
+	SimDisplay display;
+	SimServer server;
+	std::unique_ptr<Engine> engine(makeEngine<Engine>(display, server));
+	startEngine(*engine);
+
+	while(display.getReceived() < NextionDownload::BUFFER_SIZE && millis() < TIME_LIMIT_MS && !engine->getIsDone()) {
+		engine->loop();
+		HostClock::advance(1);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(size_t ii = 0; ii < ITERATIONS; ii++) {
+		engine->loop();
+	}
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	ackLatencyMs = savedLatencyMs;
+	return engine->getIsDone() ? -1 : (double) ns / ITERATIONS;
+}
+
+static void printResult(const char *name, size_t count, const Result &result) {
+	double cpuMsPerSecond = (double) result.cpuNs / 1e6 / ((double) result.simulatedMs / 1000);
+	printf("%-14s %6lu %10.1f %12.3f %10.0f %10lu %6lu/%lu\n", name, (unsigned long) count,
+			(double) result.cpuNs / (double) result.numLoops, cpuMsPerSecond, count * 1000 / cpuMsPerSecond,
+			(unsigned long) result.bytesPerTransfer, (unsigned long) result.numOk, (unsigned long) count);
+	fflush(stdout);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-n counts] [-s size] [-b baud] [-l ackLatencyMs]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<size_t> counts = {1, 10, 100, 1000};
+	size_t fileSize = 16 * NextionDownload::BUFFER_SIZE + 1234;
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:b:l:")) != -1) {
+		switch(opt) {
+		case 'n':
+			counts.clear();
+			for(const char *cp = optarg; *cp; ) {
+				char *end;
+				counts.push_back(strtoul(cp, &end, 10));
+				cp = (*end == ',') ? end + 1 : end;
+				if (end == cp) {
+					break;
+				}
+			}
+			break;
+		case 's':
+			fileSize = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			downloadBaud = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			ackLatencyMs = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc || fileSize == 0 || downloadBaud == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	Log.setEnabled(false);
+
+	fileData.resize(fileSize);
+	for(size_t ii = 0; ii < fileSize; ii++) {
+		fileData[ii] = (uint8_t) ((ii * 7) ^ (ii >> 8));
+	}
+
+	// Enough frames for the most transfers, 2 each
+	size_t maxCount = 0;
+	for(size_t count : counts) {
+		if (count > maxCount) {
+			maxCount = count;
+		}
+	}
+	std::vector<std::max_align_t> frames((2 * maxCount * NextionFramePool::FRAME_SIZE) / sizeof(std::max_align_t) + 1);
+	NextionFramePool::setStorage(frames.data(), frames.size() * sizeof(std::max_align_t));
+
+	printf("%lu byte file at %lu baud, ack latency %lu ms\n", (unsigned long) fileSize, downloadBaud, ackLatencyMs);
+	printf("%-14s %6s %10s %12s %10s %10s %8s\n", "engine", "count", "ns/loop", "CPU ms/sim s", "realtime", "bytes", "ok");
+
+	bool allOk = true;
+	for(size_t count : counts) {
+		Result result = runTransfers<NextionDownload>(count);
+		printResult("state machine", count, result);
+		allOk = allOk && result.numOk == count;
+
+		result = runTransfers<NextionCoDownload>(count);
+		printResult("coroutine", count, result);
+		allOk = allOk && result.numOk == count;
+	}
+	printf("loop() while waiting for an ack: state machine %.1f ns, coroutine %.1f ns\n",
+			measureWaitingLoop<NextionDownload>(), measureWaitingLoop<NextionCoDownload>());
+	printf("coroutine frame: %lu bytes used of %lu\n", (unsigned long) NextionFramePool::getLargestRequest(),
+			(unsigned long) NextionFramePool::FRAME_SIZE);
+
+	return allOk ? 0 : 1;
+}
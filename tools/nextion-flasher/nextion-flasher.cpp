@@ -0,0 +1,353 @@
+// Factory flasher: sends a .tft file to Nextion displays on several serial ports at once, using the
+// library's own upload code (baud rate detection, whmi-wri and the 4096 byte block and ack cadence).
+//
+// Build with make -C tools (see tools/Makefile).
+//
+// Usage:
+//   nextion-flasher [-b baud] [-j threads] [-i seconds] [-t dir] [-v] file.tft port...
+//
+// The file is mapped into memory once and shared by all ports. Each port is flashed by a
+// NextionDownload object on a POSIX tty (PosixSerial), reading the file through a transport that
+// serves it as an HTTP response from memory, so the whole protocol path is the same as on a device.
+// Up to threads ports (default: all of them) are flashed at the same time.
+//
+// -b is the baud rate to send the file at (default 115200, up to 921600 depending on the display and
+// adapter). Progress and throughput of each port are printed every -i seconds (default 2), and a
+// summary at the end. -v shows the library's log. -t writes the trace of each port (NextionTrace::dump())
+// to a file in dir, which nextion-replay can replay. The exit status is 0 only if every port succeeded.
+//
+// To try it without displays, run it on the pseudo-terminals created by nextion-emulator (make -C
+// tools check does this).
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "NextionDownloadRK.h"
+#include "PosixSerial.h"
+
+/**
+ * Serves data as the response to any request, like a server that has nothing else
+ */
+class MemoryTransport : public NextionTransport {
+public:
+	MemoryTransport(const uint8_t *data, size_t size) : data(data), size(size) {}
+	virtual ~MemoryTransport() {}
+
+	virtual bool connect(const char *hostname, uint16_t port) {
+		isConnected = true;
+		request.clear();
+		header.clear();
+		headerOffset = 0;
+		dataOffset = 0;
+		return true;
+	}
+
+	virtual bool connected() { return isConnected; }
+
+	virtual int read(uint8_t *buf, size_t bufSize) {
+		if (header.empty()) {
+			return -1;
+		}
+		size_t count = 0;
+		if (headerOffset < header.size()) {
+			count = header.size() - headerOffset;
+			if (count > bufSize) {
+				count = bufSize;
+			}
+			memcpy(buf, &header[headerOffset], count);
+			headerOffset += count;
+			return (int) count;
+		}
+		count = size - dataOffset;
+		if (count > bufSize) {
+			count = bufSize;
+		}
+		memcpy(buf, &data[dataOffset], count);
+		dataOffset += count;
+		return (count > 0) ? (int) count : -1;
+	}
+
+	virtual int write(const uint8_t *buf, size_t bufSize) {
+		request.append((const char *)buf, bufSize);
+		if (request.find("\r\n\r\n") != std::string::npos) {
+			char line[128];
+			snprintf(line, sizeof(line), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n", (unsigned long) size);
+			header = line;
+			request.clear();
+		}
+		return (int) bufSize;
+	}
+
+	virtual void stop() { isConnected = false; }
+
+protected:
+	const uint8_t *data;
+	size_t size;
+	bool isConnected = false;
+	std::string request;
+	std::string header;
+	size_t headerOffset = 0;
+	size_t dataOffset = 0;
+};
+
+struct Port {
+	std::string path;
+	std::atomic<int> status{STATUS_WAITING};
+	std::atomic<int> progress{0};
+	std::atomic<uint32_t> bytesPerSecond{0};
+	size_t bytes = 0;
+	unsigned long elapsedMs = 0;
+	const char *error = "";
+
+	static const int STATUS_WAITING = 0;
+	static const int STATUS_RUNNING = 1;
+	static const int STATUS_OK = 2;
+	static const int STATUS_FAILED = 3;
+};
+
+static const uint8_t *fileData;
+static size_t fileSize;
+static const char *fileName;
+static int downloadBaud = 115200;
+static const char *traceDir;
+
+/**
+ * A Print that writes to a file
+ */
+class FilePrint : public Print {
+public:
+	FilePrint(FILE *fp) : fp(fp) {}
+
+	virtual size_t write(uint8_t c) { return fputc(c, fp) == EOF ? 0 : 1; }
+	virtual size_t write(const uint8_t *buf, size_t size) { return fwrite(buf, 1, size, fp); }
+
+protected:
+	FILE *fp;
+};
+
+/**
+ * Writes the trace of the port to traceDir, named after the port (/dev/pts/3 is dev_pts_3.trace)
+ */
+static void writeTrace(const NextionTrace &trace, const char *portPath) {
+	std::string name = portPath;
+	while(name[0] == '/') {
+		name.erase(0, 1);
+	}
+	for(char &c : name) {
+		if (c == '/') {
+			c = '_';
+		}
+	}
+	std::string path = std::string(traceDir) + "/" + name + ".trace";
+
+	FILE *fp = fopen(path.c_str(), "w");
+	if (fp == NULL) {
+		fprintf(stderr, "could not write %s\n", path.c_str());
+		return;
+	}
+	FilePrint out(fp);
+	trace.dump(out);
+	fclose(fp);
+}
+
+static void flashPort(Port &port, size_t index) {
+	Logger::setThreadName(port.path.c_str());
+
+	unsigned long startMs = millis();
+	port.status = Port::STATUS_RUNNING;
+
+	PosixSerial serial(port.path.c_str());
+	if (!serial.open()) {
+		port.error = "could not open port";
+		port.status = Port::STATUS_FAILED;
+		return;
+	}
+
+	// About 10 events per block, plus the start
+	NextionTrace trace(fileSize / 400 + 1000);
+
+	// Each port gets its own part of the emulated EEPROM for the modification date
+	MemoryTransport transport(fileData, fileSize);
+	NextionDownload download(serial, (int)(index * NextionDownload::EEPROM_BUFFER_SIZE));
+	download
+		.withTransport(transport)
+		.withHostname("localhost")
+		.withPathPartOfUrl(fileName)
+		.withCheckModeManual()
+		.withDownloadBaud(downloadBaud);
+	if (traceDir) {
+		download.withTrace(&trace);
+	}
+
+	download.requestCheck(true);
+	while(!download.getIsDone()) {
+		download.loop();
+		port.progress = download.getProgress();
+		port.bytesPerSecond = download.getStats().bytesPerSecond;
+
+		// Blocks take tens of ms to clock out, so this doesn't slow down the transfer
+		usleep(200);
+	}
+
+	port.bytes = download.getDataOffset();
+	port.elapsedMs = millis() - startMs;
+	port.bytesPerSecond = download.getStats().bytesPerSecond;
+	if (download.getDataSize() == 0) {
+		port.error = "display not found";
+	}
+	else
+	if (download.getDataOffset() < download.getDataSize()) {
+		port.error = "upload failed";
+	}
+	port.status = (port.error[0] == 0) ? Port::STATUS_OK : Port::STATUS_FAILED;
+
+	if (traceDir) {
+		writeTrace(trace, port.path.c_str());
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-b baud] [-j threads] [-i seconds] [-t dir] [-v] file.tft port...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	size_t numThreads = 0;
+	unsigned long intervalMs = 2000;
+	bool verbose = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "b:j:i:t:v")) != -1) {
+		switch(opt) {
+		case 'b':
+			downloadBaud = atoi(optarg);
+			break;
+		case 'j':
+			numThreads = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			intervalMs = strtoul(optarg, NULL, 10) * 1000;
+			break;
+		case 't':
+			traceDir = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (!PosixSerial::isSupportedBaud(downloadBaud)) {
+		fprintf(stderr, "unsupported baud rate %d\n", downloadBaud);
+		return 2;
+	}
+
+	const char *path = argv[optind];
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		fprintf(stderr, "could not read %s\n", path);
+		return 1;
+	}
+	fileSize = st.st_size;
+	fileData = (const uint8_t *) mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (fileData == MAP_FAILED) {
+		fprintf(stderr, "could not map %s\n", path);
+		return 1;
+	}
+	fileName = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	std::vector<Port> ports(argc - optind - 1);
+	for(size_t ii = 0; ii < ports.size(); ii++) {
+		ports[ii].path = argv[optind + 1 + ii];
+	}
+	if ((ports.size() + 1) * NextionDownload::EEPROM_BUFFER_SIZE > EEPROMClass::EEPROM_SIZE) {
+		fprintf(stderr, "too many ports\n");
+		return 2;
+	}
+	if (numThreads == 0 || numThreads > ports.size()) {
+		numThreads = ports.size();
+	}
+
+	Log.setEnabled(verbose);
+
+	MD5_CTX md5Ctx;
+	unsigned char md5[16];
+	MD5_Init(&md5Ctx);
+	MD5_Update(&md5Ctx, fileData, fileSize);
+	MD5_Final(md5, &md5Ctx);
+	printf("%s: %lu bytes, md5 ", fileName, (unsigned long) fileSize);
+	for(size_t ii = 0; ii < sizeof(md5); ii++) {
+		printf("%02x", md5[ii]);
+	}
+	printf(", %lu ports at %d baud\n", (unsigned long) ports.size(), downloadBaud);
+	fflush(stdout);
+
+	// Thread pool: each thread takes the next port until there are none left
+	std::atomic<size_t> nextPort{0};
+	std::vector<std::thread> threads;
+	for(size_t ii = 0; ii < numThreads; ii++) {
+		threads.emplace_back([&]() {
+			for(size_t index = nextPort++; index < ports.size(); index = nextPort++) {
+				flashPort(ports[index], index);
+			}
+		});
+	}
+
+	unsigned long reportMs = millis();
+	while(true) {
+		bool finished = true;
+		for(const Port &port : ports) {
+			if (port.status == Port::STATUS_WAITING || port.status == Port::STATUS_RUNNING) {
+				finished = false;
+			}
+		}
+		if (finished) {
+			break;
+		}
+
+		if (millis() - reportMs >= intervalMs) {
+			reportMs = millis();
+			for(const Port &port : ports) {
+				if (port.status == Port::STATUS_RUNNING) {
+					printf("%s %3d%% %lu bytes/sec\n", port.path.c_str(), port.progress.load(), (unsigned long) port.bytesPerSecond.load());
+				}
+			}
+			fflush(stdout);
+		}
+		delay(50);
+	}
+	for(std::thread &thread : threads) {
+		thread.join();
+	}
+
+	size_t numFailed = 0;
+	for(const Port &port : ports) {
+		if (port.status == Port::STATUS_OK) {
+			printf("%s ok %lu bytes in %lu ms, %lu bytes/sec\n", port.path.c_str(), (unsigned long) port.bytes,
+					port.elapsedMs, (unsigned long) port.bytesPerSecond.load());
+		}
+		else {
+			printf("%s FAILED: %s (%lu of %lu bytes)\n", port.path.c_str(), port.error, (unsigned long) port.bytes,
+					(unsigned long) fileSize);
+			numFailed++;
+		}
+	}
+	printf("%lu of %lu ports ok\n", (unsigned long) (ports.size() - numFailed), (unsigned long) ports.size());
+
+	munmap((void *) fileData, fileSize);
+	return (numFailed == 0) ? 0 : 1;
+}
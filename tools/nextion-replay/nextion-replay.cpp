@@ -0,0 +1,578 @@
+// Replays a trace recorded with NextionDownload::withTrace() through NextionDownload on a computer, to
+// reproduce a failure seen in the field and measure the cost of the code on the same timeline.
+//
+// Build with make -C tools (see tools/Makefile).
+//
+// Usage:
+//   nextion-replay [-m mirrors] [-k] [-r bytesPerSecond] [-n iterations] [-v] trace
+//
+// trace is the output of NextionTrace::dump() (text) or copyTo() (binary). It must start at setup() or
+// the start of a check, so the trace has to be big enough to hold the whole check.
+//
+// The library only sees time through millis(), so a simulated clock that runs from the first event makes
+// it see the same times it saw on the device. The simulated display and server answer from the recorded
+// events:
+//   - ACK, FRAME and DISPLAY_ERROR events are received from the display at the time they were recorded
+//   - the display's TX buffer takes the number of bytes recorded in each UART_WRITE event at its time
+//   - each TCP_CONNECT takes until the time it was recorded, and fails if it failed
+//   - responses have the recorded status, header length and Content-Length (the data is all zeros), and
+//     TCP_READ events deliver the recorded number of bytes at their time
+//   - TCP_DISCONNECT events close the connection at their time
+// The clock jumps from one event to the next, since nothing the trace shows happened in between, and
+// loop() is called until the next event happens (or for 1 ms per call if it's late). Busy waits inside
+// the library, like detecting the baud rate, also run the clock to the next event.
+//
+// The events recorded during the replay are compared with the trace. The exit status is 0 if they are the
+// same, and 1 with the first difference printed if not. The simulated clock doesn't move during a call, so
+// an event may be 1 ms earlier than recorded where the device's clock ticked during the call. A difference means the field behavior depends on
+// something the trace doesn't capture, like the contents of the data or an event lost from the ring buffer.
+//
+// The settings the trace was recorded with that aren't in it have to be given: -m the number of mirrors
+// and -k for withKeepAlive(). -r sets withMaxBytesPerSecond(). The download baud rate and check mode are
+// found from the trace. With -n the replay is run that many times and the time spent in the library is
+// averaged. Only loop() calls that did something are made, so the time per call is the cost of a step.
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "NextionDownloadRK.h"
+
+typedef NextionTrace::Record Record;
+
+static const size_t FREE_POLLS = 16; // Polls per library call before a poll counts as a busy wait
+static const size_t MAX_LOOPS_PER_MS = 100;
+static const unsigned long END_MARGIN_MS = 10000; // How long to run past the last event
+static const uint32_t CALL_TICK_MS = 1; // How much earlier an event may be than recorded
+
+static std::vector<Record> recorded;
+
+static const char *eventName(uint8_t event) {
+	static const char *names[] = {"", "STATE", "TCP_READ", "UART_WRITE", "ACK", "BAUD", "ERROR", "FRAME",
+			"DISPLAY_ERROR", "TCP_CONNECT", "TCP_CLOSE", "HTTP_STATUS", "HTTP_HEADER", "HTTP_LENGTH",
+			"TCP_DISCONNECT", "CHECK"};
+	return (event < sizeof(names) / sizeof(names[0])) ? names[event] : "?";
+}
+
+static bool loadTrace(const char *path, std::vector<Record> &records) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return false;
+	}
+	std::string data;
+	char buf[4096];
+	size_t count;
+	while((count = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		data.append(buf, count);
+	}
+	fclose(fp);
+
+	bool isText = true;
+	for(char c : data) {
+		if (!isdigit((unsigned char)c) && c != ' ' && c != '\n' && c != '\r') {
+			isText = false;
+			break;
+		}
+	}
+
+	if (!isText) {
+		// copyTo() format
+		if (data.size() % sizeof(Record) != 0) {
+			return false;
+		}
+		records.resize(data.size() / sizeof(Record));
+		memcpy(records.data(), data.data(), data.size());
+		return true;
+	}
+
+	// dump() format: timeMs event value
+	const char *cp = data.c_str();
+	while(*cp) {
+		char *end;
+		Record rec = {};
+		rec.timeMs = strtoul(cp, &end, 10);
+		if (end == cp) {
+			break;
+		}
+		rec.event = (uint8_t) strtoul(end, &end, 10);
+		rec.value = strtoul(end, &end, 10);
+		records.push_back(rec);
+		cp = end;
+		while(*cp == '\r' || *cp == '\n' || *cp == ' ') {
+			cp++;
+		}
+	}
+	return true;
+}
+
+/**
+ * Finds the next recorded event of type event at or after index. Returns recorded.size() if there isn't one.
+ */
+static size_t findEvent(size_t index, uint8_t event) {
+	while(index < recorded.size() && recorded[index].event != event) {
+		index++;
+	}
+	return index;
+}
+
+static bool isDue(size_t index) {
+	return index < recorded.size() && (long)(millis() - recorded[index].timeMs) >= 0;
+}
+
+/**
+ * The display, sending what was recorded
+ */
+class ReplaySerial : public USARTSerial {
+public:
+	ReplaySerial(const NextionTrace &trace) : trace(trace) {}
+
+	/**
+	 * Called before each call into the library, for detecting busy waits. Sending or receiving something
+	 * also starts over, so only polls with nothing else happening count.
+	 */
+	void startCall() { polls = 0; }
+
+	virtual void begin(unsigned long baud) { polls = 0; }
+
+	virtual int available() {
+		receive();
+		if (rx.empty()) {
+			idle();
+		}
+		return (int) rx.size();
+	}
+
+	virtual int read() {
+		receive();
+		if (rx.empty()) {
+			idle();
+			return -1;
+		}
+		uint8_t c = rx[0];
+		rx.erase(0, 1);
+		polls = 0;
+		return c;
+	}
+
+	virtual int availableForWrite() {
+		writeIndex = findEvent(writeIndex, NextionTrace::EVENT_UART_WRITE);
+		if (!isDue(writeIndex)) {
+			return 0;
+		}
+		writeAllowed = true;
+		return (int) recorded[writeIndex].value;
+	}
+
+	using USARTSerial::write;
+	virtual size_t write(const uint8_t *buf, size_t size) {
+		polls = 0;
+		if (writeAllowed) {
+			// A block write, which takes the space that was reported
+			writeAllowed = false;
+			writeIndex++;
+		}
+		return size;
+	}
+
+protected:
+	void receive() {
+		static const std::string terminator("\xff\xff\xff", 3);
+
+		for(; isDue(rxIndex); rxIndex++) {
+			const Record &rec = recorded[rxIndex];
+			uint8_t code = (uint8_t) rec.value;
+			switch(rec.event) {
+			case NextionTrace::EVENT_ACK:
+				rx += '\x05';
+				break;
+
+			case NextionTrace::EVENT_DISPLAY_ERROR:
+				rx += (char) code;
+				rx += terminator;
+				break;
+
+			case NextionTrace::EVENT_FRAME:
+				// Only the first byte was recorded, which is enough to tell the frames used apart
+				if (code == 'c') {
+					rx += "comok 1,30601-0,NX4832T035_011R,52,61488,D264B8204F0E1828,16777216";
+				}
+				else
+				if (code == 0x00) {
+					rx += std::string(3, '\0');
+				}
+				else {
+					rx += (char) code;
+					if (NextionResponseDecoder::isErrorCode(code)) {
+						// It wasn't a single byte error frame
+						rx += '\0';
+					}
+				}
+				rx += terminator;
+				break;
+			}
+		}
+	}
+
+	void idle() {
+		if (++polls <= FREE_POLLS) {
+			return;
+		}
+		// Busy waiting, which lasts until the next thing the device did (the end of a timeout or receiving
+		// something). Blocking calls the trace doesn't show took some of that time on the device.
+		size_t next = trace.getCount();
+		if (next < recorded.size() && (long)(recorded[next].timeMs - millis()) > 1) {
+			HostClock::advance(recorded[next].timeMs - millis());
+		}
+		else {
+			HostClock::advance(1);
+		}
+	}
+
+	const NextionTrace &trace;
+	std::string rx;
+	size_t rxIndex = 0;
+	size_t writeIndex = 0;
+	bool writeAllowed = false;
+	size_t polls = 0;
+};
+
+/**
+ * The server, answering with what was recorded
+ */
+class ReplayTransport : public NextionTransport {
+public:
+	virtual bool connect(const char *hostname, uint16_t port) {
+		connectIndex = findEvent(connectIndex, NextionTrace::EVENT_TCP_CONNECT);
+		if (connectIndex >= recorded.size()) {
+			return false;
+		}
+		// Connecting blocks until the time the result was recorded
+		const Record &rec = recorded[connectIndex++];
+		if ((long)(rec.timeMs - millis()) > 0) {
+			HostClock::advance(rec.timeMs - millis());
+		}
+		if (rec.value == NextionTrace::CONNECT_FAILED) {
+			return false;
+		}
+		isConnected = true;
+		response.clear();
+		responseOffset = 0;
+		return true;
+	}
+
+	virtual bool connected() {
+		disconnectIndex = findEvent(disconnectIndex, NextionTrace::EVENT_TCP_DISCONNECT);
+		return isConnected && !isDue(disconnectIndex);
+	}
+
+	virtual int read(uint8_t *buf, size_t size) {
+		if (!isConnected) {
+			return -1;
+		}
+		if (readRemaining == 0) {
+			readIndex = findEvent(readIndex, NextionTrace::EVENT_TCP_READ);
+			if (!isDue(readIndex)) {
+				return -1;
+			}
+			readRemaining = recorded[readIndex++].value;
+		}
+		size_t count = (size < readRemaining) ? size : readRemaining;
+		for(size_t ii = 0; ii < count; ii++) {
+			buf[ii] = (responseOffset < response.size()) ? (uint8_t) response[responseOffset] : 0;
+			responseOffset++;
+		}
+		readRemaining -= count;
+		return (int) count;
+	}
+
+	virtual int write(const uint8_t *buf, size_t size) {
+		request.append((const char *)buf, size);
+		if (request.find("\r\n\r\n") != std::string::npos) {
+			makeResponse();
+			request.clear();
+		}
+		return (int) size;
+	}
+
+	virtual void stop() {
+		isConnected = false;
+		readRemaining = 0;
+		if (isDue(disconnectIndex)) {
+			disconnectIndex++;
+		}
+	}
+
+protected:
+	void makeResponse() {
+		size_t rangeStart = 0;
+		size_t pos = request.find("Range: bytes=");
+		if (pos != std::string::npos) {
+			rangeStart = strtoul(request.c_str() + pos + 13, NULL, 10);
+		}
+
+		statusIndex = findEvent(statusIndex, NextionTrace::EVENT_HTTP_STATUS);
+		if (statusIndex >= recorded.size()) {
+			// No response was recorded, so don't answer
+			return;
+		}
+		uint32_t status = recorded[statusIndex].value;
+		size_t headerLength = 0;
+		size_t contentLength = 0;
+		size_t index = statusIndex + 1;
+		if (index < recorded.size() && recorded[index].event == NextionTrace::EVENT_HTTP_HEADER) {
+			headerLength = recorded[index++].value;
+		}
+		if (index < recorded.size() && recorded[index].event == NextionTrace::EVENT_HTTP_LENGTH) {
+			contentLength = recorded[index++].value;
+		}
+		statusIndex = index;
+
+		// The body starts at the same offset as in the recorded response, so reads split the data the same way
+		char fields[128];
+		size_t len = snprintf(fields, sizeof(fields), "\r\nContent-Length: %lu\r\n", (unsigned long) contentLength);
+		if (status == 206) {
+			len += snprintf(&fields[len], sizeof(fields) - len, "Content-Range: bytes %lu-%lu/%lu\r\n", (unsigned long) rangeStart,
+					(unsigned long) (rangeStart + contentLength - 1), (unsigned long) (rangeStart + contentLength));
+		}
+		char statusLine[32];
+		size_t statusLength = snprintf(statusLine, sizeof(statusLine), "HTTP/1.1 %lu ", (unsigned long) status);
+
+		response = statusLine;
+		if (headerLength > statusLength + len + 2) {
+			// Pad the reason phrase
+			response.append(headerLength - statusLength - len - 2, 'x');
+		}
+		response += fields;
+		response += "\r\n";
+		responseOffset = 0;
+	}
+
+	bool isConnected = false;
+	std::string request;
+	std::string response;
+	size_t responseOffset = 0;
+	size_t connectIndex = 0;
+	size_t disconnectIndex = 0;
+	size_t readIndex = 0;
+	size_t readRemaining = 0;
+	size_t statusIndex = 0;
+};
+
+struct Settings {
+	size_t numMirrors = 0;
+	bool keepAlive = false;
+	uint32_t maxBytesPerSecond = 0;
+};
+
+/**
+ * Runs the replay once. Returns the events recorded during it, and the time spent in the library.
+ */
+static std::vector<Record> replay(const Settings &settings, uint64_t &libraryNs, size_t &numLoops) {
+	HostClock::setSimulated(recorded[0].timeMs);
+	// Erased, like the device the trace was recorded on is assumed to be
+	for(size_t ii = 0; ii < NextionDownload::EEPROM_BUFFER_SIZE; ii++) {
+		EEPROM.put((int) ii, (uint8_t) 0xff);
+	}
+
+	NextionTrace trace(recorded.size() + 1);
+	ReplaySerial serial(trace);
+	ReplayTransport transport;
+	NextionDownload download(serial, 0);
+
+	download
+		.withTransport(transport)
+		.withHostname("replay")
+		.withPathPartOfUrl("/replay.tft")
+		.withTrace(&trace);
+	for(size_t ii = 0; ii < settings.numMirrors; ii++) {
+		download.withMirror("mirror");
+	}
+	if (settings.keepAlive) {
+		download.withKeepAlive();
+	}
+	if (settings.maxBytesPerSecond) {
+		download.withMaxBytesPerSecond(settings.maxBytesPerSecond);
+	}
+
+	// The settings that can be found from the trace
+	size_t waitConnectIndex = 0;
+	size_t checkIndex = findEvent(0, NextionTrace::EVENT_CHECK);
+	for(size_t ii = 0; ii < recorded.size(); ii++) {
+		const Record &rec = recorded[ii];
+		if (rec.event != NextionTrace::EVENT_STATE) {
+			continue;
+		}
+		if (rec.value == NextionTrace::STATE_WAIT_CONNECT && waitConnectIndex == 0) {
+			waitConnectIndex = ii + 1;
+		}
+		if (rec.value == NextionTrace::STATE_MANIFEST_WAIT) {
+			download.withManifest("/manifest.txt");
+		}
+		if (rec.value == NextionTrace::STATE_START_WAIT) {
+			size_t baudIndex = findEvent(ii, NextionTrace::EVENT_BAUD);
+			if (baudIndex < recorded.size()) {
+				download.withDownloadBaud(recorded[baudIndex].value);
+			}
+		}
+	}
+	bool atBoot = (waitConnectIndex != 0);
+	if (atBoot) {
+		// The network becomes ready when the check started
+		download.withCheckModeAtBoot();
+		WiFi.setReady(false);
+	}
+	else {
+		download.withCheckModeManual();
+	}
+
+	libraryNs = 0;
+	numLoops = 0;
+	size_t appIndex = 0;
+	size_t loopsThisMs = 0;
+	unsigned long endMs = recorded.back().timeMs + END_MARGIN_MS;
+	while((long)(millis() - endMs) < 0) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		if (atBoot && checkIndex < recorded.size()) {
+			WiFi.setReady(isDue(checkIndex));
+		}
+
+		// Calls the app made outside of loop()
+		for(; isDue(appIndex); appIndex++) {
+			const Record &rec = recorded[appIndex];
+			if (rec.event == NextionTrace::EVENT_STATE && rec.value == NextionTrace::STATE_SETUP) {
+				serial.startCall();
+				download.setup();
+			}
+			if (rec.event == NextionTrace::EVENT_CHECK && !atBoot) {
+				serial.startCall();
+				download.requestCheck(rec.value != 0);
+			}
+		}
+
+		serial.startCall();
+		download.loop();
+		numLoops++;
+
+		libraryNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+		size_t produced = trace.getCount();
+		if (produced > recorded.size() || (produced == recorded.size() && download.getIsDone())) {
+			break;
+		}
+
+		if (produced < recorded.size() && !isDue(produced)) {
+			// Nothing the trace shows happened on the device until the next event
+			loopsThisMs = 0;
+			HostClock::advance(recorded[produced].timeMs - millis());
+		}
+		else
+		if (++loopsThisMs >= MAX_LOOPS_PER_MS || produced >= recorded.size()) {
+			// Late (the replay is diverging) or past the end of the trace
+			loopsThisMs = 0;
+			HostClock::advance(1);
+		}
+	}
+	WiFi.setReady(true);
+
+	std::vector<Record> result(trace.getCount());
+	trace.copyTo((uint8_t *)result.data(), result.size() * sizeof(Record));
+	return result;
+}
+
+static void printRecord(const char *label, size_t index, const std::vector<Record> &records) {
+	if (index < records.size()) {
+		const Record &rec = records[index];
+		printf("  %s %5lu: %lu %s %lu\n", label, (unsigned long) index, (unsigned long) rec.timeMs, eventName(rec.event), (unsigned long) rec.value);
+	}
+	else {
+		printf("  %s %5lu: (none)\n", label, (unsigned long) index);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-m mirrors] [-k] [-r bytesPerSecond] [-n iterations] [-v] trace\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	Settings settings;
+	size_t iterations = 1;
+	bool verbose = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "m:kr:n:v")) != -1) {
+		switch(opt) {
+		case 'm':
+			settings.numMirrors = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			settings.keepAlive = true;
+			break;
+		case 'r':
+			settings.maxBytesPerSecond = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind + 1 != argc || iterations == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (!loadTrace(argv[optind], recorded) || recorded.empty()) {
+		fprintf(stderr, "could not read a trace from %s\n", argv[optind]);
+		return 1;
+	}
+	const Record &first = recorded[0];
+	if (!(first.event == NextionTrace::EVENT_CHECK ||
+		(first.event == NextionTrace::EVENT_STATE && (first.value == NextionTrace::STATE_SETUP || first.value == NextionTrace::STATE_START)))) {
+		fprintf(stderr, "the trace doesn't start at setup() or a check; it may have wrapped around\n");
+		return 1;
+	}
+
+	Log.setEnabled(verbose);
+
+	uint64_t libraryNs;
+	size_t numLoops;
+	std::vector<Record> replayed = replay(settings, libraryNs, numLoops);
+
+	// Later runs are only for timing
+	Log.setEnabled(false);
+	for(size_t ii = 1; ii < iterations; ii++) {
+		uint64_t ns;
+		size_t loops;
+		replay(settings, ns, loops);
+		libraryNs += ns;
+	}
+	libraryNs /= iterations;
+
+	printf("%lu events over %lu ms, %lu loop() calls, %lu ns per call\n", (unsigned long) recorded.size(),
+			(unsigned long) (recorded.back().timeMs - recorded[0].timeMs), (unsigned long) numLoops,
+			(unsigned long) (numLoops ? libraryNs / numLoops : 0));
+
+	for(size_t ii = 0; ii < recorded.size() || ii < replayed.size(); ii++) {
+		bool same = ii < recorded.size() && ii < replayed.size() &&
+				recorded[ii].timeMs - replayed[ii].timeMs <= CALL_TICK_MS &&
+				recorded[ii].event == replayed[ii].event && recorded[ii].value == replayed[ii].value;
+		if (!same) {
+			printf("replay differs at event %lu:\n", (unsigned long) ii);
+			for(size_t jj = (ii > 3) ? ii - 3 : 0; jj <= ii + 3; jj++) {
+				printRecord("recorded", jj, recorded);
+				printRecord("replayed", jj, replayed);
+			}
+			return 1;
+		}
+	}
+	printf("replay matches the trace\n");
+	return 0;
+}
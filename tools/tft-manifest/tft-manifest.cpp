@@ -0,0 +1,215 @@
+// Generates the manifest read by NextionDownload::withManifest() for a directory of .tft files.
+//
+// Build with make -C tools (see tools/Makefile).
+//
+// Usage:
+//   tft-manifest [-j threads] [-o manifest.txt] directory
+//
+// Each .tft file under directory (recursively) is hashed with the same md5.cpp the device uses, so the
+// hash always matches what NextionDownload calculates while downloading. The files are hashed in
+// parallel, one file per thread at a time.
+//
+// The manifest is text, one file per line, sorted by name:
+//   <size> <md5> <model> <name>
+// name is relative to directory, with / as the separator, so the manifest should be published at the
+// top of that directory. model is the display model found in the TFT header (like NX4832T035_011), or -
+// if there isn't one. Lines starting with # are comments.
+
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "md5.h"
+
+static const size_t BLOCK_SIZE = 4096; // Same as NextionDownload::BUFFER_SIZE
+static const size_t HEADER_SCAN_SIZE = 4096;
+
+struct Entry {
+	std::string path;
+	std::string name;
+	size_t size = 0;
+	char md5Hex[33] = {0};
+	std::string model = "-";
+	bool ok = false;
+};
+
+// Finds a model name like NX4832T035_011R in the header. Returns an empty string if there isn't one.
+static std::string findModel(const uint8_t *data, size_t size) {
+	if (size > HEADER_SCAN_SIZE) {
+		size = HEADER_SCAN_SIZE;
+	}
+	for(size_t ii = 0; ii + 11 <= size; ii++) {
+		// NX, 4 digits, series letter, 3 digits
+		const uint8_t *cp = &data[ii];
+		if (cp[0] != 'N' || cp[1] != 'X') {
+			continue;
+		}
+		bool match = isdigit(cp[2]) && isdigit(cp[3]) && isdigit(cp[4]) && isdigit(cp[5]) && isupper(cp[6]) &&
+				isdigit(cp[7]) && isdigit(cp[8]) && isdigit(cp[9]);
+		if (!match) {
+			continue;
+		}
+		size_t len = 10;
+		// Optional _011 and a letter
+		if (ii + len + 4 <= size && cp[len] == '_' && isdigit(cp[len + 1]) && isdigit(cp[len + 2]) && isdigit(cp[len + 3])) {
+			len += 4;
+			if (ii + len < size && isupper(cp[len])) {
+				len++;
+			}
+		}
+		return std::string((const char *) cp, len);
+	}
+	return std::string();
+}
+
+static void hashFile(Entry &entry) {
+	int fd = open(entry.path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "could not open %s\n", entry.path.c_str());
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "could not stat %s\n", entry.path.c_str());
+		close(fd);
+		return;
+	}
+	entry.size = (size_t) st.st_size;
+
+	MD5_CTX ctx;
+	MD5_Init(&ctx);
+
+	if (entry.size > 0) {
+		const uint8_t *data = (const uint8_t *) mmap(NULL, entry.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "could not map %s\n", entry.path.c_str());
+			close(fd);
+			return;
+		}
+		madvise((void *) data, entry.size, MADV_SEQUENTIAL);
+
+		std::string model = findModel(data, entry.size);
+		if (!model.empty()) {
+			entry.model = model;
+		}
+
+		// In blocks, the way the device does it
+		for(size_t offset = 0; offset < entry.size; offset += BLOCK_SIZE) {
+			size_t count = std::min(BLOCK_SIZE, entry.size - offset);
+			MD5_Update(&ctx, &data[offset], count);
+		}
+		munmap((void *) data, entry.size);
+	}
+	close(fd);
+
+	unsigned char out[16];
+	MD5_Final(out, &ctx);
+	for(size_t ii = 0; ii < sizeof(out); ii++) {
+		snprintf(&entry.md5Hex[ii * 2], 3, "%02x", out[ii]);
+	}
+	entry.ok = true;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: tft-manifest [-j threads] [-o manifest.txt] directory\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned numThreads = std::thread::hardware_concurrency();
+	const char *outPath = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "j:o:")) != -1) {
+		switch(opt) {
+		case 'j':
+			numThreads = (unsigned) atoi(optarg);
+			break;
+		case 'o':
+			outPath = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+	}
+	if (numThreads == 0) {
+		numThreads = 1;
+	}
+
+	std::filesystem::path dir(argv[optind]);
+	std::vector<Entry> entries;
+	std::error_code ec;
+	for(auto it = std::filesystem::recursive_directory_iterator(dir, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (!it->is_regular_file() || strcasecmp(it->path().extension().c_str(), ".tft") != 0) {
+			continue;
+		}
+		Entry entry;
+		entry.path = it->path().string();
+		entry.name = it->path().lexically_relative(dir).generic_string();
+		if (entry.name.find_first_of("\r\n") != std::string::npos) {
+			fprintf(stderr, "skipping %s, the name can't be in the manifest\n", entry.path.c_str());
+			continue;
+		}
+		entries.push_back(entry);
+	}
+	if (ec) {
+		fprintf(stderr, "could not read %s: %s\n", dir.c_str(), ec.message().c_str());
+		return 1;
+	}
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.name < b.name; });
+
+	// Each thread takes the next file until there are none left
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	for(unsigned ii = 0; ii < numThreads && ii < entries.size(); ii++) {
+		threads.emplace_back([&]() {
+			for(size_t index = next++; index < entries.size(); index = next++) {
+				hashFile(entries[index]);
+			}
+		});
+	}
+	for(auto &thread : threads) {
+		thread.join();
+	}
+
+	FILE *out = stdout;
+	if (outPath) {
+		out = fopen(outPath, "w");
+		if (out == NULL) {
+			fprintf(stderr, "could not create %s\n", outPath);
+			return 1;
+		}
+	}
+
+	int failures = 0;
+	fprintf(out, "# NextionDownloadRK manifest: <size> <md5> <model> <name>\n");
+	for(const Entry &entry : entries) {
+		if (!entry.ok) {
+			failures++;
+			continue;
+		}
+		fprintf(out, "%zu %s %s %s\n", entry.size, entry.md5Hex, entry.model.c_str(), entry.name.c_str());
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	return failures ? 1 : 0;
+}